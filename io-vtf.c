@@ -31,10 +31,32 @@
 #include <gdk-pixbuf/gdk-pixbuf-animation.h>
 #include <glib/gstdio.h>
 
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VTF_X86 1
+#include <immintrin.h>
+#define VTF_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 #define VTF_70_HEADER_SIZE       63
 #define VTF_71_HEADER_SIZE       65
 #define VTF_73_HEADER_SIZE       72
 #define VTF_RESOURCE_HEADER_SIZE  8
+#define VTF_RESOURCES_OFFSET     80     // the resource directory follows the 7.3 header
+#define VTF_MAX_RESOURCES        32
+
+// Resource directory tags (the three bytes, little endian)
+#define VTF_RESOURCE_LOWRES      0x000001
+#define VTF_RESOURCE_SHEET       0x000010
+#define VTF_RESOURCE_HIGHRES     0x000030
+#define VTF_RESOURCE_CRC         0x435243   // "CRC"
+#define VTF_RESOURCE_LOD         0x444f4c   // "LOD"
+#define VTF_RESOURCE_KVD         0x44564b   // "KVD"
+#define VTF_RESOURCE_NO_DATA     0x02       // the entry holds a value, not an offset
 
 typedef struct
 {
@@ -59,6 +81,16 @@ typedef struct
                                    // Must be a power of 2. Can be 0 or 1 for a 2D texture (v7.2 only).
     uint8_t    padding2[3];        // padding
     uint32_t   resources;          // VTF 7.3 resource count
+
+    // From the resource directory (7.3 and later); offsets are 0 if absent.
+    uint32_t   lowResOffset;       // File offset of the low resolution image.
+    uint32_t   highResOffset;      // File offset of the mip chain.
+    uint32_t   sheetOffset;        // File offset of the particle sheet data.
+    uint32_t   keyValuesOffset;    // File offset of the key values data.
+    uint32_t   crc;                // CRC of the source image, if hasCrc.
+    gboolean   hasCrc;
+    uint8_t    lodClampU;          // Mip clamps from the LOD resource.
+    uint8_t    lodClampV;
 } VtfHeader;
 
 enum
@@ -141,6 +173,97 @@ enum
 	TEXTUREFLAGS_UNUSED_80000000 = 0x80000000
 };
 
+// A part of the file that is kept in the buffer, starting at pos.
+typedef struct
+{
+    guint start;
+    guint end;
+    guint pos;
+} VtfRange;
+
+// header, three preview mips and the frame being loaded
+#define VTF_MAX_RANGES 5
+
+// Animated textures are played at 8 frames per second, looping.
+#define VTF_FRAME_DELAY 125
+
+// decoded frames an animation keeps besides frame 0
+#define VTF_FRAME_RING 3
+
+// Pixels shared by the pixbufs of an animation's ring, freed along with
+// the last of them.
+typedef struct
+{
+    gint refs;
+    guchar *pixels;
+} VtfSlab;
+
+/*
+ * A multi-frame texture as an animation that keeps the raw, still
+ * block-compressed data of its frames and decodes a frame only when an
+ * iterator gets to it. Frame 0 is the static image and is always kept;
+ * other frames are decoded into a small ring of pixbufs, each new one over
+ * the oldest that no iterator is showing, so playing it back allocates
+ * nothing. The ring's pixels are one slab, allocated the first time a
+ * frame is decoded.
+ *
+ * Frames that repeat an earlier one byte for byte, as blinking lights and
+ * looping screens do, share its slice of raw data and its pixbuf.
+ */
+typedef struct
+{
+    GdkPixbufAnimation parent_instance;
+
+    uint32_t image_format;
+    uint width;
+    uint height;
+    uint frames;
+    uint loaded;                // frames whose data is complete
+    gboolean loading;           // more frames may still arrive
+
+    // The raw data of each distinct frame, in slices stride bytes apart,
+    // either in bytes or in raw, and the slice each frame shows.
+    const guchar *data;
+    gsize stride;
+    GBytes *bytes;              // the file, when frames are read from it in place
+    guchar *raw;                // otherwise a copy of each new slice as it arrives
+    uint *slices;               // frame 0 is always slice 0
+    uint slice_count;
+    GHashTable *hashes;         // slice by hash of its data, while loading
+
+    GdkPixbuf *first;
+    GdkPixbuf *ring[VTF_FRAME_RING];
+    uint ring_slice[VTF_FRAME_RING];
+    uint ring_pins[VTF_FRAME_RING]; // iterators showing each slot
+    uint ring_next;             // the slot to decode into next
+    VtfSlab *slab;
+} VtfAnim;
+
+typedef struct
+{
+    GdkPixbufAnimationClass parent_class;
+} VtfAnimClass;
+
+// The animation interface is still defined in terms of GTimeVal.
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+typedef struct
+{
+    GdkPixbufAnimationIter parent_instance;
+
+    VtfAnim *anim;
+    GTimeVal start_time;
+    GTimeVal current_time;
+    uint frame;
+    GdkPixbuf *pixbuf;          // the frame last handed out
+    int slot;                   // the ring slot it is in, or -1
+} VtfAnimIter;
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+typedef struct
+{
+    GdkPixbufAnimationIterClass parent_class;
+} VtfAnimIterClass;
+
 typedef struct
 {
     GdkPixbufModuleSizeFunc     size_func;
@@ -151,42 +274,35 @@ typedef struct
     guchar *buffer;
     guint buffer_size;
     guint buffer_data_size;
-} VtfContext;
+    guint expected_size;        // bytes kept once the layout is known, 0 if unknown
 
-static size_t frame_size(uint32_t image_format, uint16_t width, uint16_t height) {
-    switch (image_format) {
-        case IMAGE_FORMAT_NONE:              return 0;
-        case IMAGE_FORMAT_RGBA8888:          return width * height * 4;
-        case IMAGE_FORMAT_ABGR8888:          return width * height * 4;
-        case IMAGE_FORMAT_RGB888:            return width * height * 3;
-        case IMAGE_FORMAT_BGR888:            return width * height * 3;
-        case IMAGE_FORMAT_RGB565:            return width * height * 2;
-        case IMAGE_FORMAT_I8:                return width * height * 1;
-        case IMAGE_FORMAT_IA88:              return width * height * 2;
-//      case IMAGE_FORMAT_P8:                return TODO;
-        case IMAGE_FORMAT_A8:                return width * height * 1;
-//      case IMAGE_FORMAT_RGB888_BLUESCREEN: return TODO;
-//      case IMAGE_FORMAT_BGR888_BLUESCREEN: return TODO;
-        case IMAGE_FORMAT_ARGB8888:          return width * height * 4;
-        case IMAGE_FORMAT_BGRA8888:          return width * height * 4;
-        case IMAGE_FORMAT_DXT1:              return ((width+3)/4) * ((height+3)/4) * 8;
-//      case IMAGE_FORMAT_DXT3:              return TODO;
-        case IMAGE_FORMAT_DXT5:              return ((width+3)/4) * ((height+3)/4) * 16;
-//      case IMAGE_FORMAT_BGRX8888:          return TODO;
-//      case IMAGE_FORMAT_BGR565:            return TODO;
-//      case IMAGE_FORMAT_BGRX5551:          return TODO;
-//      case IMAGE_FORMAT_BGRA4444:          return TODO;
-//      case IMAGE_FORMAT_DXT1_ONEBITALPHA:  return TODO;
-//      case IMAGE_FORMAT_BGRA5551:          return TODO;
-//      case IMAGE_FORMAT_UV88:              return TODO;
-//      case IMAGE_FORMAT_UVWQ8888:          return TODO;
-        case IMAGE_FORMAT_RGBA16161616F:     return width * height * 8;
-        case IMAGE_FORMAT_RGBA16161616:      return width * height * 8;
-//      case IMAGE_FORMAT_UVLX8888:          return TODO;
-        // not yet supported or illegal value
-        default:                             return SIZE_MAX;
-    }
-}
+    // Once the header tells where everything is, only the parts of the
+    // file that will be decoded are kept and the rest is dropped as it
+    // arrives. Until then, and if it never does, everything is kept.
+    VtfRange ranges[VTF_MAX_RANGES];
+    uint range_count;
+    gsize file_pos;             // bytes of the file seen so far
+
+    // owns buffer once the file is complete, so frames can share it
+    GBytes *bytes;
+    gboolean mapped;            // buffer is the whole file, mapped by load
+
+    VtfHeader header;
+    gboolean header_parsed;
+    gboolean stopped;           // nothing more to decode
+    gboolean thumbnail;         // the low-res image covers the requested size
+    gint requested_width;       // size asked for by size_func
+    gint requested_height;
+    uint mip;                   // the mip being loaded
+
+    // progressive preview
+    uint image_offset;          // start of the mip chain, 0 if unknown
+    int preview_mip;            // largest mip that may still be previewed
+    VtfAnim *anim;
+    GdkPixbuf *first;           // frame 0, handed out before the file is complete
+    uint rows_done;             // rows of frame 0 decoded at full size
+    uint frame;                 // frame of the mip being loaded that is arriving
+} VtfContext;
 
 // cube maps have 6 or 7 faces, other maps have only 1
 /*
@@ -197,568 +313,3158 @@ static size_t face_count(const VtfHeader *header) {
 }
 */
 
-static float read_float16(const uint8_t **data) {
-    union {
-        uint16_t bits[2];
-        float    fval;
-    } val;
-    
-    val.bits[0] = 0;
-    memcpy(&val.bits[1], *data, 2);
-    *data += 2;
+/*
+ * Block decoders
+ *
+ * A row kernel decodes `blocks` consecutive compressed blocks from src into
+ * the four pixel rows starting at dst, 16 RGBA bytes per block per row.
+ * The scalar versions are the reference; the SIMD versions must produce
+ * bit-identical output.
+ */
 
-    return val.fval;
-}
+typedef void (*VtfRowFunc) (const uint8_t *src, guchar *dst, size_t stride, uint blocks);
+typedef void (*VtfCopyFunc) (guchar *dst, const uint8_t *src, size_t size);
 
-static uint16_t read_le16(const uint8_t **data) {
-    uint16_t val = 0;
-    memcpy(&val, *data, sizeof(val));
-    *data += sizeof(val);
-    return val;
-}
+typedef enum
+{
+    VTF_ISA_SCALAR,
+    VTF_ISA_SSE2,
+    VTF_ISA_SSSE3,
+    VTF_ISA_AVX2,
+    VTF_ISA_AVX512,
+    VTF_ISA_COUNT
+} VtfIsa;
 
-static gpointer
-gdk_pixbuf__vtf_image_begin_load (GdkPixbufModuleSizeFunc size_func,
-                                  GdkPixbufModulePreparedFunc prepared_func,
-                                  GdkPixbufModuleUpdatedFunc updated_func,
-                                  gpointer user_data,
-                                  GError **error)
+/*
+ * Decodes the colour half of a block. DXT1 blocks (alpha == FALSE) may use
+ * the three-colour mode with transparent black and also write alpha;
+ * DXT3/DXT5 colour blocks are always four-colour and leave alpha alone.
+ */
+static void
+vtf_dxt_color_block_scalar (const uint8_t *src, guchar *dst, size_t stride, gboolean alpha)
 {
-    VtfContext* context = g_malloc(sizeof(VtfContext));
-    if (context == NULL) {
-    	g_set_error (
-    		error,
-    		GDK_PIXBUF_ERROR,
-    		GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-    		("Not enough memory"));
-    	return NULL;
-    }
-    
-    context->size_func = size_func;
-    context->prepared_func = prepared_func;
-    context->updated_func = updated_func;
-    context->user_data = user_data;
-    
-    context->buffer_size = 1000000;
-    context->buffer = g_malloc(context->buffer_size);
-    context->buffer_data_size = 0;
-    
-    return (gpointer) context;
-}
+    uint16_t c0 = src[0] | src[1] << 8;
+    uint16_t c1 = src[2] | src[3] << 8;
 
-static uint
-vtf_mip_size(VtfHeader *header, uint mipLevel, uint depth) {
-    uint mipWidth  = header->width  >> mipLevel;
-    uint mipHeight = header->height >> mipLevel;
-    uint mipDepth  = depth          >> mipLevel;
+    uint16_t r[4], g[4], b[4], a[4];
 
-    if (mipWidth < 1) mipWidth = 1;
-    if (mipHeight < 1) mipHeight = 1;
-    if (mipDepth < 1) mipDepth = 1;
+    r[0] = (c0 >> 11) & 31;
+    r[0] = (r[0] << 3) | (r[0] >> 5);
+    g[0] = (c0 >> 5) & 63;
+    g[0] = (g[0] << 2) | (g[0] >> 6);
+    b[0] = (c0 >> 0) & 31;
+    b[0] = (b[0] << 3) | (b[0] >> 5);
 
-    return frame_size(header->highResImageFormat, mipWidth, mipHeight) * mipDepth;
-}
+    r[1] = (c1 >> 11) & 31;
+    r[1] = (r[1] << 3) | (r[1] >> 5);
+    g[1] = (c1 >> 5) & 63;
+    g[1] = (g[1] << 2) | (g[1] >> 6);
+    b[1] = (c1 >> 0) & 31;
+    b[1] = (b[1] << 3) | (b[1] >> 5);
 
-static uint
-vtf_offset(VtfHeader *header, uint frame, uint face, uint slice, int mipLevel)
-{
-    uint offset = 0;
-    uint facecount = 1;
+    a[0] = 255;
+    a[1] = 255;
 
-    for (int i = header->mipmapCount - 1; i > mipLevel; i--)
-        offset += vtf_mip_size (header, i, header->depth);
+    if(alpha || c0 > c1) {
+        r[2] = (4*r[0] + 2*r[1] + 3)/6;
+        g[2] = (4*g[0] + 2*g[1] + 3)/6;
+        b[2] = (4*b[0] + 2*b[1] + 3)/6;
+        a[2] = 255;
 
-    offset *= header->frames * facecount;
+        r[3] = (2*r[0] + 4*r[1] + 3)/6;
+        g[3] = (2*g[0] + 4*g[1] + 3)/6;
+        b[3] = (2*b[0] + 4*b[1] + 3)/6;
+        a[3] = 255;
+    } else {
+        r[2] = (r[0] + r[1] + 1)/2;
+        g[2] = (g[0] + g[1] + 1)/2;
+        b[2] = (b[0] + b[1] + 1)/2;
+        a[2] = 255;
 
-    uint volume_bytes = vtf_mip_size (header, mipLevel, header->depth);
-    uint slice_bytes  = vtf_mip_size (header, mipLevel, 1);
+        r[3] = 0;
+        g[3] = 0;
+        b[3] = 0;
+        a[3] = 0;
+    }
 
-    offset += volume_bytes * (frame * facecount + face);
-    offset += slice_bytes  * slice;
+    uint32_t sel = src[4] | src[5] << 8 | src[6] << 16 | (uint32_t)src[7] << 24;
 
-    return offset;
+    for (int ii = 0; ii < 4; ii++)
+        for (int jj = 0; jj < 4; jj++) {
+            dst[stride*ii + 4*jj + 0] = r[sel & 3];
+            dst[stride*ii + 4*jj + 1] = g[sel & 3];
+            dst[stride*ii + 4*jj + 2] = b[sel & 3];
+            if (!alpha)
+                dst[stride*ii + 4*jj + 3] = a[sel & 3];
+            sel >>= 2;
+        }
 }
 
-static GdkPixbuf*
-gdk_pixbuf__vtf_load_frame (VtfHeader *header, VtfContext *context, GError **error, int pos) {
-    int i, j;
-    GdkPixbuf* pixbuf;
+static void
+vtf_dxt1_row_scalar (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 8, dst += 16)
+        vtf_dxt_color_block_scalar(src, dst, stride, FALSE);
+}
 
-    if(header->highResImageFormat == IMAGE_FORMAT_RGBA8888) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 0] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 1] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 2] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 3] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_ABGR8888) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 3] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 2] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 1] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 0] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_RGB888) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 3*j + 0] = context->buffer[pos++];
-                pixels[stride*i + 3*j + 1] = context->buffer[pos++];
-                pixels[stride*i + 3*j + 2] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_BGR888) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 3*j + 2] = context->buffer[pos++];
-                pixels[stride*i + 3*j + 1] = context->buffer[pos++];
-                pixels[stride*i + 3*j + 0] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_RGB565) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-        	    uint16_t c0 = context->buffer[pos++];
-        	    c0 |= context->buffer[pos++] << 8;
-        	    
-        	    uint16_t r, g, b;
-        	    r = (c0 >> 11) & 31;
-        	    r = (r << 3) | (r >> 5);
-        	    g = (c0 >> 5) & 63;
-        	    g = (g << 2) | (g >> 6);
-        	    b = (c0 >> 0) & 31;
-        	    b = (b << 3) | (b >> 5);
-        	    
-                pixels[stride*i + 3*j + 0] = r;
-                pixels[stride*i + 3*j + 1] = g;
-                pixels[stride*i + 3*j + 2] = b;
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_I8) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-        	    uint8_t v = context->buffer[pos++];
-        	    
-                pixels[stride*i + 3*j + 0] = v;
-                pixels[stride*i + 3*j + 1] = v;
-                pixels[stride*i + 3*j + 2] = v;
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_IA88) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-        	    uint8_t v = context->buffer[pos++];
-        	    
-                pixels[stride*i + 4*j + 0] = v;
-                pixels[stride*i + 4*j + 1] = v;
-                pixels[stride*i + 4*j + 2] = v;
-                pixels[stride*i + 4*j + 3] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_A8) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 0] = 255;
-                pixels[stride*i + 4*j + 1] = 255;
-                pixels[stride*i + 4*j + 2] = 255;
-                pixels[stride*i + 4*j + 3] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_DXT1) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i+=4) {
-        	for (j = 0; j < header->width; j+=4) {
-        	    uint16_t c0 = context->buffer[pos++];
-        	    c0 |= context->buffer[pos++] << 8;
-        	    
-        	    uint16_t c1 = context->buffer[pos++];
-        	    c1 |= context->buffer[pos++] << 8;
-        	    
-        	    uint16_t r[4], g[4], b[4];
-        	    
-        	    r[0] = (c0 >> 11) & 31;
-        	    r[0] = (r[0] << 3) | (r[0] >> 5);
-        	    g[0] = (c0 >> 5) & 63;
-        	    g[0] = (g[0] << 2) | (g[0] >> 6);
-        	    b[0] = (c0 >> 0) & 31;
-        	    b[0] = (b[0] << 3) | (b[0] >> 5);
-        	    
-        	    r[1] = (c1 >> 11) & 31;
-        	    r[1] = (r[1] << 3) | (r[1] >> 5);
-        	    g[1] = (c1 >> 5) & 63;
-        	    g[1] = (g[1] << 2) | (g[1] >> 6);
-        	    b[1] = (c1 >> 0) & 31;
-        	    b[1] = (b[1] << 3) | (b[1] >> 5);
-        	    
-        	    uint16_t a[4];
-        	    a[0] = 255;
-        	    a[1] = 255;
-        	    
-        	    if(c0 > c1) {
-        	        r[2] = (4*r[0] + 2*r[1] + 3)/6;
-        	        g[2] = (4*g[0] + 2*g[1] + 3)/6;
-        	        b[2] = (4*b[0] + 2*b[1] + 3)/6;
-        	        a[2] = 255;
-        	        
-        	        r[3] = (2*r[0] + 4*r[1] + 3)/6;
-        	        g[3] = (2*g[0] + 4*g[1] + 3)/6;
-        	        b[3] = (2*b[0] + 4*b[1] + 3)/6;
-        	        a[3] = 255;
-        	    } else {
-        	        r[2] = (r[0] + r[1] + 1)/2;
-        	        g[2] = (g[0] + g[1] + 1)/2;
-        	        b[2] = (b[0] + b[1] + 1)/2;
-        	        a[2] = 255;
-        	        
-        	        r[3] = 0;
-        	        g[3] = 0;
-        	        b[3] = 0;
-        	        a[3] = 0;
-        	    }
-        	    
-        	    uint32_t sel = context->buffer[pos++];
-        	    sel |= context->buffer[pos++] << 8;
-        	    sel |= context->buffer[pos++] << 16;
-        	    sel |= context->buffer[pos++] << 24;
-        	    
-        	    int ii, jj;
-        	    for(ii = 0; ii < 4; ii++)
-            	    for(jj = 0; jj < 4; jj++) {
-            	        pixels[stride*(i+ii) + 4*(j+jj) + 0] = r[sel & 3];
-            	        pixels[stride*(i+ii) + 4*(j+jj) + 1] = g[sel & 3];
-            	        pixels[stride*(i+ii) + 4*(j+jj) + 2] = b[sel & 3];
-            	        pixels[stride*(i+ii) + 4*(j+jj) + 3] = a[sel & 3];
-                		sel >>= 2;
-                    }
-        	}
-        }
-    } else if(header->highResImageFormat == IMAGE_FORMAT_DXT5) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i+=4) {
-        	for (j = 0; j < header->width; j+=4) {
-        	    {
-            	    uint16_t a[8];
-            	    
-            	    a[0] = context->buffer[pos++];
-            	    a[1] = context->buffer[pos++];
-            	    
-            	    if(a[0] > a[1]) {
-            	        a[2] = (12*a[0] + 2*a[1] + 7)/14;
-            	        a[3] = (10*a[0] + 4*a[1] + 7)/14;
-            	        a[4] = (8*a[0] + 6*a[1] + 7)/14;
-            	        a[5] = (6*a[0] + 8*a[1] + 7)/14;
-            	        a[6] = (4*a[0] + 10*a[1] + 7)/14;
-            	        a[7] = (2*a[0] + 12*a[1] + 7)/14;
-            	    } else {
-            	        a[2] = (8*a[0] + 2*a[1] + 5)/10;
-            	        a[3] = (6*a[0] + 4*a[1] + 5)/10;
-            	        a[4] = (4*a[0] + 6*a[1] + 5)/10;
-            	        a[5] = (2*a[0] + 8*a[1] + 5)/10;
-            	        a[6] = 0;
-            	        a[7] = 255;
-            	    }
-            	    
-            	    uint64_t sel = context->buffer[pos++];
-            	    sel |= (uint64_t)context->buffer[pos++] << 8;
-            	    sel |= (uint64_t)context->buffer[pos++] << 16;
-            	    sel |= (uint64_t)context->buffer[pos++] << 24;
-            	    sel |= (uint64_t)context->buffer[pos++] << 32;
-            	    sel |= (uint64_t)context->buffer[pos++] << 40;
-            	    
-            	    int ii, jj;
-            	    for(ii = 0; ii < 4; ii++)
-                	    for(jj = 0; jj < 4; jj++) {
-                	        pixels[stride*(i+ii) + 4*(j+jj)+3] = a[sel & 7];
-                    		sel >>= 3;
-                        }
-                }
-                {
-            	    uint16_t c0 = context->buffer[pos++];
-            	    c0 |= context->buffer[pos++] << 8;
-            	    
-            	    uint16_t c1 = context->buffer[pos++];
-            	    c1 |= context->buffer[pos++] << 8;
-            	    
-            	    uint16_t r[4], g[4], b[4];
-            	    
-            	    r[0] = (c0 >> 11) & 31;
-            	    r[0] = (r[0] << 3) | (r[0] >> 5);
-            	    g[0] = (c0 >> 5) & 63;
-            	    g[0] = (g[0] << 2) | (g[0] >> 6);
-            	    b[0] = (c0 >> 0) & 31;
-            	    b[0] = (b[0] << 3) | (b[0] >> 5);
-            	    
-            	    r[1] = (c1 >> 11) & 31;
-            	    r[1] = (r[1] << 3) | (r[1] >> 5);
-            	    g[1] = (c1 >> 5) & 63;
-            	    g[1] = (g[1] << 2) | (g[1] >> 6);
-            	    b[1] = (c1 >> 0) & 31;
-            	    b[1] = (b[1] << 3) | (b[1] >> 5);
-            	    
-        	        r[2] = (4*r[0] + 2*r[1] + 3)/6;
-        	        g[2] = (4*g[0] + 2*g[1] + 3)/6;
-        	        b[2] = (4*b[0] + 2*b[1] + 3)/6;
-        	        
-        	        r[3] = (2*r[0] + 4*r[1] + 3)/6;
-        	        g[3] = (2*g[0] + 4*g[1] + 3)/6;
-        	        b[3] = (2*b[0] + 4*b[1] + 3)/6;
-            	    
-            	    uint32_t sel = context->buffer[pos++];
-            	    sel |= context->buffer[pos++] << 8;
-            	    sel |= context->buffer[pos++] << 16;
-            	    sel |= context->buffer[pos++] << 24;
-            	    
-            	    int ii, jj;
-            	    for(ii = 0; ii < 4; ii++)
-                	    for(jj = 0; jj < 4; jj++) {
-                	        pixels[stride*(i+ii) + 4*(j+jj) + 0] = r[sel & 3];
-                	        pixels[stride*(i+ii) + 4*(j+jj) + 1] = g[sel & 3];
-                	        pixels[stride*(i+ii) + 4*(j+jj) + 2] = b[sel & 3];
-                    		sel >>= 2;
-                        }
-                }
-        	}
-        }
-    } else if(header->highResImageFormat == IMAGE_FORMAT_ARGB8888) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 1] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 2] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 3] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 0] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_BGRA8888) {
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        for (i = 0; i < header->height; i++)
-        	for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 2] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 1] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 0] = context->buffer[pos++];
-                pixels[stride*i + 4*j + 3] = context->buffer[pos++];
-        	}
-    } else if(header->highResImageFormat == IMAGE_FORMAT_RGBA16161616F) {
-        // won't accept 16 bit color depth so I have to convert it to 8 bit
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        const uint8_t *hdrdata = context->buffer + pos;
-        for (i = 0; i < header->height; i++) {
-            for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 0] = lrintf(read_float16(&hdrdata) * 255);
-                pixels[stride*i + 4*j + 1] = lrintf(read_float16(&hdrdata) * 255);
-                pixels[stride*i + 4*j + 2] = lrintf(read_float16(&hdrdata) * 255);
-                pixels[stride*i + 4*j + 3] = lrintf(read_float16(&hdrdata) * 255);
-            }
-        }
-    } else if(header->highResImageFormat == IMAGE_FORMAT_RGBA16161616) {
-        // won't accept 16 bit color depth so I have to convert it to 8 bit
-        pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, header->width, header->height);
-        if (pixbuf == NULL) {
-            goto pixbufallocerror;
-        }
-        uint32_t stride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
-        const uint8_t *hdrdata = context->buffer + pos;
-        for (i = 0; i < header->height; i++) {
-            for (j = 0; j < header->width; j++) {
-                pixels[stride*i + 4*j + 0] = read_le16(&hdrdata) / 257;
-                pixels[stride*i + 4*j + 1] = read_le16(&hdrdata) / 257;
-                pixels[stride*i + 4*j + 2] = read_le16(&hdrdata) / 257;
-                pixels[stride*i + 4*j + 3] = read_le16(&hdrdata) / 257;
-                pos += 8;
+static void
+vtf_dxt3_row_scalar (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 16, dst += 16) {
+        for (int ii = 0; ii < 4; ii++)
+            for (int jj = 0; jj < 4; jj++) {
+                uint8_t v = src[2*ii + jj/2] >> (4 * (jj & 1)) & 15;
+                dst[stride*ii + 4*jj + 3] = v | v << 4;
             }
-        }
-    } else {
-        goto unsupported;
+
+        vtf_dxt_color_block_scalar(src + 8, dst, stride, TRUE);
     }
+}
 
-    return pixbuf;
+static void
+vtf_dxt5_row_scalar (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 16, dst += 16) {
+        uint16_t a[8];
 
-pixbufallocerror:
-    g_set_error (
-        error,
-        GDK_PIXBUF_ERROR,
-        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-        "Could not allocate pixbuf object");
-    return NULL;
+        a[0] = src[0];
+        a[1] = src[1];
 
-unsupported:
-    /*fprintf(stderr,"Unsupported VTF format - version %u.%u, lowres format %u, highres format %u.\n",
-        header->version[0], header->version[1], header->lowResImageFormat, header->highResImageFormat);*/
-    g_set_error (
-        error,
-        GDK_PIXBUF_ERROR,
-        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-        "Can't read this yet.");
-    return NULL;
+        if(a[0] > a[1]) {
+            a[2] = (12*a[0] + 2*a[1] + 7)/14;
+            a[3] = (10*a[0] + 4*a[1] + 7)/14;
+            a[4] = (8*a[0] + 6*a[1] + 7)/14;
+            a[5] = (6*a[0] + 8*a[1] + 7)/14;
+            a[6] = (4*a[0] + 10*a[1] + 7)/14;
+            a[7] = (2*a[0] + 12*a[1] + 7)/14;
+        } else {
+            a[2] = (8*a[0] + 2*a[1] + 5)/10;
+            a[3] = (6*a[0] + 4*a[1] + 5)/10;
+            a[4] = (4*a[0] + 6*a[1] + 5)/10;
+            a[5] = (2*a[0] + 8*a[1] + 5)/10;
+            a[6] = 0;
+            a[7] = 255;
+        }
+
+        uint64_t sel = src[2];
+        sel |= (uint64_t)src[3] << 8;
+        sel |= (uint64_t)src[4] << 16;
+        sel |= (uint64_t)src[5] << 24;
+        sel |= (uint64_t)src[6] << 32;
+        sel |= (uint64_t)src[7] << 40;
+
+        for (int ii = 0; ii < 4; ii++)
+            for (int jj = 0; jj < 4; jj++) {
+                dst[stride*ii + 4*jj + 3] = a[sel & 7];
+                sel >>= 3;
+            }
+
+        vtf_dxt_color_block_scalar(src + 8, dst, stride, TRUE);
+    }
 }
 
-static gboolean
-gdk_pixbuf__vtf_image_stop_load (gpointer context_ptr, GError **error)
+/*
+ * Channel swizzles
+ *
+ * The 8-bit RGB and RGBA formats differ from the pixbuf layout only in
+ * channel order. Each is described by the file byte that feeds each pixbuf
+ * channel; vtf_swizzle_init turns that into pshufb masks for 16-byte
+ * (4 bpp) or 48-byte (3 bpp, 16 pixels) chunks.
+ */
+
+typedef struct
 {
-    VtfContext *context = (VtfContext *) context_ptr;
-    gboolean retval = TRUE;
+    uint     bpp;                   // Bytes per pixel, in the file and in the pixbuf.
+    uint8_t  order[4];              // File byte feeding each pixbuf channel.
+    uint8_t  mask[3][3][16] __attribute__((aligned(16)));
+                                    // Bytes of output vector r taken from input vector q.
+} VtfSwizzle;
 
-    if (context->buffer_data_size < sizeof(VtfHeader))
-        goto corrupt;
+// Indexed by format. RGBA8888 needs no swizzle and is copied instead.
+static VtfSwizzle vtf_swizzles[] = {
+    [IMAGE_FORMAT_ABGR8888] = { 4, { 3, 2, 1, 0 }, { { { 0 } } } },
+    [IMAGE_FORMAT_RGB888]   = { 3, { 0, 1, 2 },    { { { 0 } } } },
+    [IMAGE_FORMAT_BGR888]   = { 3, { 2, 1, 0 },    { { { 0 } } } },
+    [IMAGE_FORMAT_ARGB8888] = { 4, { 3, 0, 1, 2 }, { { { 0 } } } },
+    [IMAGE_FORMAT_BGRA8888] = { 4, { 2, 1, 0, 3 }, { { { 0 } } } },
+};
 
-    VtfHeader header;
-    memcpy(&header, context->buffer, sizeof(header));
+static void
+vtf_swizzle_init (VtfSwizzle *swizzle)
+{
+    uint chunk = swizzle->bpp == 4 ? 16 : 48;
 
-    if(header.signature[0] != 'V' || header.signature[1] != 'T' || header.signature[2] != 'F' || header.signature[3] != 0 || header.frames == 0)
-        goto corrupt;
+    memset(swizzle->mask, 0x80, sizeof(swizzle->mask));
+    for (uint o = 0; o < chunk; o++) {
+        uint s = o - o % swizzle->bpp + swizzle->order[o % swizzle->bpp];
+        swizzle->mask[o / 16][s / 16][o % 16] = s % 16;
+    }
+}
 
-    if (header.version[0] < 7 || (header.version[0] == 7 && header.version[1] < 2))
-        header.depth = 1;
+static void
+vtf_swizzle_row_scalar (const VtfSwizzle *swizzle, const uint8_t *src, guchar *dst, uint width)
+{
+    uint bpp = swizzle->bpp;
 
-    if (header.version[0] < 7 || (header.version[0] == 7 && header.version[1] < 3))
-        header.resources = 0;
+    for (uint j = 0; j < width; j++, src += bpp, dst += bpp)
+        for (uint c = 0; c < bpp; c++)
+            dst[c] = src[swizzle->order[c]];
+}
 
-    uint fulldata = vtf_offset(&header, 0, 0, 0, -1);
+/*
+ * Half-float conversion
+ *
+ * Halves are widened with the mantissa/exponent/offset tables from
+ * "Fast Half Float Conversions" (van der Zijp) unless the CPU has F16C.
+ * Colour channels are then rolled off above VTF_HDR_KNEE so HDR values
+ * keep some detail instead of clipping, alpha is clamped, and both are
+ * rounded to 8 bits. Every path performs the same float operations in the
+ * same order, so all ISA levels give identical bytes.
+ */
 
-    if (context->buffer_data_size < fulldata)
-        goto corrupt;
+typedef void (*VtfPixelFunc) (const uint8_t *src, guchar *dst, uint width);
 
-    uint base = context->buffer_data_size - fulldata;
+#define VTF_HDR_KNEE  0.8f
+#define VTF_HALF_MAX  65504.0f
 
-    GdkPixbufSimpleAnim *anim = gdk_pixbuf_simple_anim_new(header.width, header.height, 8);
-    gdk_pixbuf_simple_anim_set_loop(anim, TRUE);
+static uint32_t vtf_half_mantissa[2048];
+static uint32_t vtf_half_exponent[64];
+static uint16_t vtf_half_offset[64];
 
-    for (int i=0; i < header.frames; i++) {
-        GdkPixbuf *pixbuf = gdk_pixbuf__vtf_load_frame(&header, context, error,
-            base + vtf_offset(&header, i, 0, 0, 0));
-        if (!pixbuf) {
-            g_object_unref(anim);
-            goto end;
+static void
+vtf_half_init (void)
+{
+    vtf_half_mantissa[0] = 0;
+    for (uint32_t i = 1; i < 1024; i++) {
+        uint32_t m = i << 13, e = 0;
+        while (!(m & 0x00800000)) {
+            e -= 0x00800000;
+            m <<= 1;
         }
-
-        gdk_pixbuf_simple_anim_add_frame(anim, pixbuf);
-
-        if (i == 0)
-            context->prepared_func(pixbuf, GDK_PIXBUF_ANIMATION(anim), context->user_data);
+        vtf_half_mantissa[i] = (m & ~0x00800000) | (e + 0x38800000);
     }
+    for (uint32_t i = 1024; i < 2048; i++)
+        vtf_half_mantissa[i] = 0x38000000 + ((i - 1024) << 13);
 
-end:
-    g_free(context->buffer);
-    g_free(context);
-    
-    return retval;
+    vtf_half_exponent[0] = 0;
+    vtf_half_exponent[32] = 0x80000000;
+    for (uint32_t i = 1; i < 31; i++) {
+        vtf_half_exponent[i] = i << 23;
+        vtf_half_exponent[i + 32] = 0x80000000 | i << 23;
+    }
+    vtf_half_exponent[31] = 0x47800000;
+    vtf_half_exponent[63] = 0xC7800000;
 
-corrupt:
-    g_set_error (
-        error,
-        GDK_PIXBUF_ERROR,
-        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-        "File corrupt or incomplete");
-    retval = FALSE;
-    goto end;
+    for (uint32_t i = 0; i < 64; i++)
+        vtf_half_offset[i] = (i == 0 || i == 32) ? 0 : 1024;
 }
 
+static inline float
+vtf_half_to_float (uint16_t h)
+{
+    union {
+        uint32_t bits;
+        float    fval;
+    } val;
+
+    val.bits = vtf_half_mantissa[vtf_half_offset[h >> 10] + (h & 0x3ff)] + vtf_half_exponent[h >> 10];
+    return val.fval;
+}
 
-static gboolean
-gdk_pixbuf__vtf_image_load_increment (gpointer      context_ptr,
-                                      const guchar *data,
-                                      guint         size,
-                                      GError      **error)
+static inline guchar
+vtf_quantize_hdr (float v, gboolean alpha)
 {
-    VtfContext* context = (VtfContext*) context_ptr;
-    
-    context->buffer_data_size += size;
-    
-    if(context->buffer_data_size > context->buffer_size) {
-        while(context->buffer_data_size > context->buffer_size)
-            context->buffer_size *= 2;
-        context->buffer = g_realloc(context->buffer, context->buffer_size);
-        if(context->buffer == NULL) {
-        	g_set_error (
-        		error,
-        		GDK_PIXBUF_ERROR,
-        		GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
-        		("Not enough memory"));
-        	return FALSE;
-        }
+    v = v > 0 ? MIN(v, VTF_HALF_MAX) : 0;      // also maps NaN to 0
+    if (alpha) {
+        v = MIN(v, 1.0f);
+    } else {
+        float t = MAX(v - VTF_HDR_KNEE, 0.0f);
+        v = MIN(v, VTF_HDR_KNEE) + (1.0f - VTF_HDR_KNEE) * t / (t + (1.0f - VTF_HDR_KNEE));
     }
-    
-    memcpy(context->buffer + context->buffer_data_size - size, data, size);
-    
-    return TRUE;
+    return lrintf(v * 255);
 }
 
-#ifndef INCLUDE_vtf
-#define MODULE_ENTRY(function) G_MODULE_EXPORT void function
-#else
-#define MODULE_ENTRY(function) void _gdk_pixbuf__vtf_ ## function
-#endif
+static void
+vtf_rgba16f_row_scalar (const uint8_t *src, guchar *dst, uint width)
+{
+    for (uint j = 0; j < 4 * width; j++, src += 2)
+        dst[j] = vtf_quantize_hdr(vtf_half_to_float(src[0] | src[1] << 8), j % 4 == 3);
+}
 
-MODULE_ENTRY (fill_vtable) (GdkPixbufModule* module)
+/*
+ * Simple per-pixel converters
+ *
+ * These are written once as plain loops and compiled once per ISA level by
+ * VTF_PIXEL_KERNEL, so the vectorizer can use each level's instructions.
+ * This is what target_clones would give us, but selected by our own
+ * dispatch so that GDK_PIXBUF_VTF_ISA can force a level.
+ */
+
+#define VTF_INLINE static inline __attribute__((always_inline))
+
+VTF_INLINE void
+vtf_rgba8888_row_body (const uint8_t *src, guchar *dst, uint width)
+{
+    memcpy(dst, src, (size_t)width * 4);
+}
+
+VTF_INLINE void
+vtf_rgb565_row_body (const uint8_t *src, guchar *dst, uint width)
 {
+    for (uint j = 0; j < width; j++, src += 2, dst += 3) {
+        uint16_t c0 = src[0] | src[1] << 8;
+
+        uint16_t r, g, b;
+        r = (c0 >> 11) & 31;
+        r = (r << 3) | (r >> 5);
+        g = (c0 >> 5) & 63;
+        g = (g << 2) | (g >> 6);
+        b = (c0 >> 0) & 31;
+        b = (b << 3) | (b >> 5);
+
+        dst[0] = r;
+        dst[1] = g;
+        dst[2] = b;
+    }
+}
+
+VTF_INLINE void
+vtf_i8_row_body (const uint8_t *src, guchar *dst, uint width)
+{
+    for (uint j = 0; j < width; j++, dst += 3) {
+        dst[0] = src[j];
+        dst[1] = src[j];
+        dst[2] = src[j];
+    }
+}
+
+VTF_INLINE void
+vtf_ia88_row_body (const uint8_t *src, guchar *dst, uint width)
+{
+    for (uint j = 0; j < width; j++, src += 2, dst += 4) {
+        dst[0] = src[0];
+        dst[1] = src[0];
+        dst[2] = src[0];
+        dst[3] = src[1];
+    }
+}
+
+VTF_INLINE void
+vtf_a8_row_body (const uint8_t *src, guchar *dst, uint width)
+{
+    for (uint j = 0; j < width; j++, dst += 4) {
+        dst[0] = 255;
+        dst[1] = 255;
+        dst[2] = 255;
+        dst[3] = src[j];
+    }
+}
+
+#define VTF_PIXEL_CLONE(name, isa) \
+    static void name##_##isa (const uint8_t *src, guchar *dst, uint width) \
+    { name##_body(src, dst, width); }
+
+#ifdef VTF_X86
+#define VTF_PIXEL_KERNEL(name) \
+    VTF_PIXEL_CLONE(name, scalar) \
+    VTF_TARGET("sse2") VTF_PIXEL_CLONE(name, sse2) \
+    VTF_TARGET("ssse3") VTF_PIXEL_CLONE(name, ssse3) \
+    VTF_TARGET("avx2") VTF_PIXEL_CLONE(name, avx2) \
+    VTF_TARGET("avx512f,avx512bw") VTF_PIXEL_CLONE(name, avx512)
+#else
+#define VTF_PIXEL_KERNEL(name) VTF_PIXEL_CLONE(name, scalar)
+#endif
+
+VTF_PIXEL_KERNEL (vtf_rgba8888_row)
+VTF_PIXEL_KERNEL (vtf_rgb565_row)
+VTF_PIXEL_KERNEL (vtf_i8_row)
+VTF_PIXEL_KERNEL (vtf_ia88_row)
+VTF_PIXEL_KERNEL (vtf_a8_row)
+
+/*
+ * 16-bit to 8-bit narrowing
+ *
+ * gdk-pixbuf won't accept 16 bit color depth, so RGBA16161616 is rounded
+ * to 8 bits. mulhi(v, 0xff01) is v/257 in 8.8 fixed point, close enough
+ * that adding 128 and shifting gives round(v/257) for every v. For
+ * ordered dithering the 128 is replaced with 4x4 Bayer thresholds that
+ * average 128, so flat areas keep their value and gradients don't band.
+ *
+ * A bias row holds one offset per channel for four pixels; row 4 is plain
+ * rounding, rows 0-3 are the dither pattern for y & 3.
+ */
+
+typedef void (*VtfDitherFunc) (const uint8_t *src, guchar *dst, uint width, uint y);
+
+#define VTF_BIAS_ROUND 4
+
+static uint16_t vtf_rgba16_bias[5][16] __attribute__((aligned(32)));
+
+static void
+vtf_rgba16_init (void)
+{
+    static const uint8_t bayer[4][4] = {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 },
+    };
+
+    for (uint c = 0; c < 16; c++) {
+        for (uint y = 0; y < 4; y++)
+            vtf_rgba16_bias[y][c] = bayer[y][c / 4] * 16 + 8;
+        vtf_rgba16_bias[VTF_BIAS_ROUND][c] = 128;
+    }
+}
+
+static void
+vtf_rgba16_narrow_scalar (const uint8_t *src, guchar *dst, uint width, const uint16_t *bias)
+{
+    for (uint j = 0; j < 4 * width; j++, src += 2)
+        dst[j] = ((((src[0] | src[1] << 8) * 0xff01u) >> 16) + bias[j % 16]) >> 8;
+}
+
+#define VTF_NARROW_ROWS(isa) \
+    static void \
+    vtf_rgba16_row_##isa (const uint8_t *src, guchar *dst, uint width) \
+    { vtf_rgba16_narrow_##isa(src, dst, width, vtf_rgba16_bias[VTF_BIAS_ROUND]); } \
+    static void \
+    vtf_rgba16_dither_row_##isa (const uint8_t *src, guchar *dst, uint width, uint y) \
+    { vtf_rgba16_narrow_##isa(src, dst, width, vtf_rgba16_bias[y % 4]); }
+
+VTF_NARROW_ROWS (scalar)
+
+#ifdef VTF_X86
+
+/*
+ * The SIMD kernels build the palette in 16-bit lanes laid out as
+ * [r0 g0 b0 a0 | r1 g1 b1 a1] per block (one block per 128-bit lane), so
+ * the two interpolated colours fall out of a single multiply-high by
+ * 65536/6 and packing the endpoints and interpolants gives the four RGBA
+ * palette entries as consecutive dwords.
+ */
+
+#define VTF_565_MASK    0xF800, 0x07E0, 0x001F, 0x0000, 0xF800, 0x07E0, 0x001F, 0x0000
+#define VTF_565_SHR     256, 8192, 0, 0, 256, 8192, 0, 0
+#define VTF_565_SHL     0, 0, 8, 0, 0, 0, 8, 0
+#define VTF_565_ALPHA   0, 0, 0, 255, 0, 0, 0, 255
+#define VTF_COLOR_LO    0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 2, 3, 2, 3, 2, 3
+#define VTF_COLOR_HI    8, 9, 8, 9, 8, 9, 8, 9, 10, 11, 10, 11, 10, 11, 10, 11
+#define VTF_DIV6        10923
+#define VTF_DIV10       6554
+#define VTF_DIV14       4682
+
+/*
+ * DXT5 alpha ramps, one 16-bit lane per palette entry:
+ * a[k] = (w0*a0 + w1*a1 + 7) / 14 or (w0*a0 + w1*a1 + 5) / 10, with the
+ * divisions done as a multiply-high by 65536/14 and 65536/10 (exact for
+ * every input up to 255). Lanes 0 and 1 reproduce the endpoints.
+ */
+#define VTF_ALPHA8_W0   14, 0, 12, 10, 8, 6, 4, 2
+#define VTF_ALPHA8_W1   0, 14, 2, 4, 6, 8, 10, 12
+#define VTF_ALPHA6_W0   10, 0, 8, 6, 4, 2, 0, 0
+#define VTF_ALPHA6_W1   0, 10, 2, 4, 6, 8, 0, 0
+#define VTF_ALPHA6_MAX  0, 0, 0, 0, 0, 0, 0, 255
+
+/*
+ * Pixel p of a DXT5 alpha block uses bits 3p..3p+2 of the 48-bit selector
+ * starting at byte 2. Each pixel gathers the two bytes holding its bits
+ * into a 16-bit lane and a multiply by 2^(8 - 3p%8) moves them to bits 8-10.
+ */
+#define VTF_ALPHA_IDX_LO  2, 3, 2, 3, 2, 3, 3, 4, 3, 4, 3, 4, 4, 5, 4, 5
+#define VTF_ALPHA_IDX_HI  5, 6, 5, 6, 5, 6, 6, 7, 6, 7, 6, 7, 7, 8, 7, 8
+#define VTF_ALPHA_IDX_MUL 256, 32, 4, 128, 16, 2, 64, 8
+#define VTF_ALPHA_A0      0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1
+#define VTF_ALPHA_A1      1, -1, 1, -1, 1, -1, 1, -1, 1, -1, 1, -1, 1, -1, 1, -1
+
+// Moves the four alpha bytes of block row r into byte 3 of each pixel.
+static const uint8_t vtf_alpha_row_masks[4][16] __attribute__((aligned(16))) = {
+    { 0x80, 0x80, 0x80,  0, 0x80, 0x80, 0x80,  1, 0x80, 0x80, 0x80,  2, 0x80, 0x80, 0x80,  3 },
+    { 0x80, 0x80, 0x80,  4, 0x80, 0x80, 0x80,  5, 0x80, 0x80, 0x80,  6, 0x80, 0x80, 0x80,  7 },
+    { 0x80, 0x80, 0x80,  8, 0x80, 0x80, 0x80,  9, 0x80, 0x80, 0x80, 10, 0x80, 0x80, 0x80, 11 },
+    { 0x80, 0x80, 0x80, 12, 0x80, 0x80, 0x80, 13, 0x80, 0x80, 0x80, 14, 0x80, 0x80, 0x80, 15 }
+};
+
+#define VTF_ALPHA_ROW_MASK(r) _mm_load_si128 ((const __m128i *) vtf_alpha_row_masks[r])
+
+VTF_TARGET("sse2") static inline __m128i
+vtf_select_sse2 (__m128i a, __m128i b, __m128i m)
+{
+    return _mm_or_si128 (_mm_and_si128 (m, b), _mm_andnot_si128 (m, a));
+}
+
+// alpha is OR'd into every palette entry; four_only forces the
+// four-colour interpolation used by DXT3/DXT5 colour blocks.
+VTF_TARGET("sse2") static inline __m128i
+vtf_dxt_palette_sse2 (__m128i c, __m128i alpha, __m128i four_only)
+{
+    const __m128i mask = _mm_setr_epi16 (VTF_565_MASK);
+    const __m128i bias = _mm_set1_epi16 ((short) 0x8000);
+
+    __m128i m  = _mm_and_si128 (c, mask);
+    __m128i x  = _mm_or_si128 (_mm_or_si128 (
+                     _mm_mulhi_epu16 (m, _mm_setr_epi16 (VTF_565_SHR)),
+                     _mm_mullo_epi16 (m, _mm_setr_epi16 (VTF_565_SHL))),
+                     alpha);
+    __m128i xs = _mm_shuffle_epi32 (x, 0x4E);
+
+    __m128i four = _mm_add_epi16 (_mm_add_epi16 (_mm_slli_epi16 (x, 2), _mm_slli_epi16 (xs, 1)),
+                                  _mm_set1_epi16 (3));
+    four = _mm_mulhi_epu16 (four, _mm_set1_epi16 (VTF_DIV6));
+    __m128i three = _mm_and_si128 (_mm_avg_epu16 (x, xs), _mm_setr_epi32 (-1, -1, 0, 0));
+
+    __m128i gt = _mm_cmpgt_epi16 (_mm_xor_si128 (c, bias),
+                                  _mm_xor_si128 (_mm_shuffle_epi32 (c, 0x4E), bias));
+    gt = _mm_or_si128 (_mm_shuffle_epi32 (gt, 0x00), four_only);
+
+    return _mm_packus_epi16 (x, vtf_select_sse2 (three, four, gt));
+}
+
+// Writes one 4x4 block given its palette and a vector of its selector.
+// alpha, if not NULL, holds four row vectors OR'd into the output.
+VTF_TARGET("sse2") static inline void
+vtf_dxt_emit_sse2 (__m128i pal, __m128i sel, const __m128i *alpha, guchar *dst, size_t stride)
+{
+    const __m128i lo_bits = _mm_setr_epi32 (1, 4, 16, 64);
+    const __m128i hi_bits = _mm_setr_epi32 (2, 8, 32, 128);
+
+    __m128i p0 = _mm_shuffle_epi32 (pal, 0x00);
+    __m128i p1 = _mm_shuffle_epi32 (pal, 0x55);
+    __m128i p2 = _mm_shuffle_epi32 (pal, 0xAA);
+    __m128i p3 = _mm_shuffle_epi32 (pal, 0xFF);
+
+    for (int ii = 0; ii < 4; ii++) {
+        __m128i lo = _mm_cmpeq_epi32 (_mm_and_si128 (sel, lo_bits), lo_bits);
+        __m128i hi = _mm_cmpeq_epi32 (_mm_and_si128 (sel, hi_bits), hi_bits);
+        __m128i row = vtf_select_sse2 (vtf_select_sse2 (p0, p1, lo),
+                                       vtf_select_sse2 (p2, p3, lo), hi);
+        if (alpha != NULL)
+            row = _mm_or_si128 (row, alpha[ii]);
+        _mm_storeu_si128 ((__m128i *) (dst + stride*ii), row);
+        sel = _mm_srli_epi32 (sel, 8);
+    }
+}
+
+// Colour block of a DXT1 block (bytes 0-7) or DXT3/DXT5 block (bytes 8-15)
+// spread as [c0 c0 c0 c0 c1 c1 c1 c1].
+VTF_TARGET("sse2") static inline __m128i
+vtf_dxt_colors_sse2 (__m128i v, int offset)
+{
+    __m128i c = offset ? _mm_unpackhi_epi16 (v, v) : _mm_unpacklo_epi16 (v, v);
+    return _mm_unpacklo_epi32 (c, c);
+}
+
+VTF_TARGET("sse2") static inline void
+vtf_dxt1_block_sse2 (const uint8_t *src, guchar *dst, size_t stride)
+{
+    __m128i v = _mm_loadl_epi64 ((const __m128i *) src);
+    __m128i pal = vtf_dxt_palette_sse2 (vtf_dxt_colors_sse2 (v, 0),
+                                        _mm_setr_epi16 (VTF_565_ALPHA), _mm_setzero_si128 ());
+
+    vtf_dxt_emit_sse2 (pal, _mm_shuffle_epi32 (v, 0x55), NULL, dst, stride);
+}
+
+VTF_TARGET("sse2") static void
+vtf_dxt1_row_sse2 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 8, dst += 16)
+        vtf_dxt1_block_sse2 (src, dst, stride);
+}
+
+// SSSE3 adds nothing for DXT1, whose palette lookup is a two-level select.
+#define vtf_dxt1_row_ssse3 vtf_dxt1_row_sse2
+
+// Expands the sixteen 4-bit DXT3 alpha values in the low 8 bytes of v to
+// bytes, n -> n * 17.
+VTF_TARGET("sse2") static inline __m128i
+vtf_dxt3_alpha_sse2 (__m128i v)
+{
+    const __m128i nibble = _mm_set1_epi8 (0x0F);
+    __m128i x = _mm_unpacklo_epi8 (_mm_and_si128 (v, nibble),
+                                   _mm_and_si128 (_mm_srli_epi16 (v, 4), nibble));
+    return _mm_or_si128 (x, _mm_slli_epi16 (x, 4));
+}
+
+VTF_TARGET("sse2") static inline void
+vtf_dxt3_block_sse2 (const uint8_t *src, guchar *dst, size_t stride)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    __m128i v = _mm_loadu_si128 ((const __m128i *) src);
+    __m128i pal = vtf_dxt_palette_sse2 (vtf_dxt_colors_sse2 (v, 1), zero, _mm_set1_epi32 (-1));
+    __m128i alpha = vtf_dxt3_alpha_sse2 (v);
+
+    __m128i lo = _mm_unpacklo_epi8 (zero, alpha);
+    __m128i hi = _mm_unpackhi_epi8 (zero, alpha);
+    __m128i rows[4] = {
+        _mm_unpacklo_epi16 (zero, lo), _mm_unpackhi_epi16 (zero, lo),
+        _mm_unpacklo_epi16 (zero, hi), _mm_unpackhi_epi16 (zero, hi)
+    };
+
+    vtf_dxt_emit_sse2 (pal, _mm_shuffle_epi32 (v, 0xFF), rows, dst, stride);
+}
+
+VTF_TARGET("sse2") static void
+vtf_dxt3_row_sse2 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 16, dst += 16)
+        vtf_dxt3_block_sse2 (src, dst, stride);
+}
+
+// The unpacks already place DXT3 alpha; pshufb would not save anything.
+#define vtf_dxt3_row_ssse3 vtf_dxt3_row_sse2
+
+// The eight DXT5 alpha values from broadcast endpoints a0 and a1.
+VTF_TARGET("sse2") static inline __m128i
+vtf_dxt5_alphas_sse2 (__m128i a0, __m128i a1)
+{
+    __m128i eight = _mm_add_epi16 (_mm_add_epi16 (
+                        _mm_mullo_epi16 (a0, _mm_setr_epi16 (VTF_ALPHA8_W0)),
+                        _mm_mullo_epi16 (a1, _mm_setr_epi16 (VTF_ALPHA8_W1))),
+                        _mm_set1_epi16 (7));
+    __m128i six   = _mm_add_epi16 (_mm_add_epi16 (
+                        _mm_mullo_epi16 (a0, _mm_setr_epi16 (VTF_ALPHA6_W0)),
+                        _mm_mullo_epi16 (a1, _mm_setr_epi16 (VTF_ALPHA6_W1))),
+                        _mm_set1_epi16 (5));
+
+    eight = _mm_mulhi_epu16 (eight, _mm_set1_epi16 (VTF_DIV14));
+    six   = _mm_or_si128 (_mm_mulhi_epu16 (six, _mm_set1_epi16 (VTF_DIV10)),
+                          _mm_setr_epi16 (VTF_ALPHA6_MAX));
+
+    return vtf_select_sse2 (six, eight, _mm_cmpgt_epi16 (a0, a1));
+}
+
+/*
+ * Without pshufb the alpha lookup is a three-level select per row; the
+ * 12 selector bits of a row are split into lanes by multiplying each
+ * lane's copy so that its three bits land at bits 9-11.
+ */
+VTF_TARGET("sse2") static inline void
+vtf_dxt5_block_sse2 (const uint8_t *src, guchar *dst, size_t stride)
+{
+    const __m128i one = _mm_set1_epi32 (1), two = _mm_set1_epi32 (2), four = _mm_set1_epi32 (4);
+    __m128i v = _mm_loadu_si128 ((const __m128i *) src);
+    __m128i pal = vtf_dxt_palette_sse2 (vtf_dxt_colors_sse2 (v, 1),
+                                        _mm_setzero_si128 (), _mm_set1_epi32 (-1));
+
+    __m128i apal = vtf_dxt5_alphas_sse2 (_mm_set1_epi16 (src[0]), _mm_set1_epi16 (src[1]));
+    __m128i alo = _mm_slli_epi32 (_mm_unpacklo_epi16 (apal, _mm_setzero_si128 ()), 24);
+    __m128i ahi = _mm_slli_epi32 (_mm_unpackhi_epi16 (apal, _mm_setzero_si128 ()), 24);
+    __m128i a[8] = {
+        _mm_shuffle_epi32 (alo, 0x00), _mm_shuffle_epi32 (alo, 0x55),
+        _mm_shuffle_epi32 (alo, 0xAA), _mm_shuffle_epi32 (alo, 0xFF),
+        _mm_shuffle_epi32 (ahi, 0x00), _mm_shuffle_epi32 (ahi, 0x55),
+        _mm_shuffle_epi32 (ahi, 0xAA), _mm_shuffle_epi32 (ahi, 0xFF)
+    };
+
+    uint64_t bits;
+    memcpy(&bits, src, sizeof(bits));
+    bits >>= 16;
+
+    __m128i rows[4];
+    for (int ii = 0; ii < 4; ii++) {
+        __m128i idx = _mm_set1_epi32 ((bits >> 12*ii) & 0xFFF);
+        idx = _mm_srli_epi32 (_mm_mullo_epi16 (idx, _mm_setr_epi16 (512, 0, 64, 0, 8, 0, 1, 0)), 9);
+
+        __m128i m0 = _mm_cmpeq_epi32 (_mm_and_si128 (idx, one), one);
+        __m128i m1 = _mm_cmpeq_epi32 (_mm_and_si128 (idx, two), two);
+        __m128i m2 = _mm_cmpeq_epi32 (_mm_and_si128 (idx, four), four);
+
+        __m128i lo = vtf_select_sse2 (vtf_select_sse2 (a[0], a[1], m0),
+                                      vtf_select_sse2 (a[2], a[3], m0), m1);
+        __m128i hi = vtf_select_sse2 (vtf_select_sse2 (a[4], a[5], m0),
+                                      vtf_select_sse2 (a[6], a[7], m0), m1);
+        rows[ii] = vtf_select_sse2 (lo, hi, m2);
+    }
+
+    vtf_dxt_emit_sse2 (pal, _mm_shuffle_epi32 (v, 0xFF), rows, dst, stride);
+}
+
+VTF_TARGET("sse2") static void
+vtf_dxt5_row_sse2 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 16, dst += 16)
+        vtf_dxt5_block_sse2 (src, dst, stride);
+}
+
+// Expands the DXT5 alpha block in the low 8 bytes of v to 16 alpha bytes.
+VTF_TARGET("ssse3") static inline __m128i
+vtf_dxt5_alpha_ssse3 (__m128i v)
+{
+    const __m128i mul = _mm_setr_epi16 (VTF_ALPHA_IDX_MUL);
+
+    __m128i lo = _mm_shuffle_epi8 (v, _mm_setr_epi8 (VTF_ALPHA_IDX_LO));
+    __m128i hi = _mm_shuffle_epi8 (v, _mm_setr_epi8 (VTF_ALPHA_IDX_HI));
+    lo = _mm_srli_epi16 (_mm_mullo_epi16 (lo, mul), 8);
+    hi = _mm_srli_epi16 (_mm_mullo_epi16 (hi, mul), 8);
+    __m128i idx = _mm_and_si128 (_mm_packus_epi16 (lo, hi), _mm_set1_epi8 (7));
+
+    __m128i apal = vtf_dxt5_alphas_sse2 (_mm_shuffle_epi8 (v, _mm_setr_epi8 (VTF_ALPHA_A0)),
+                                         _mm_shuffle_epi8 (v, _mm_setr_epi8 (VTF_ALPHA_A1)));
+
+    return _mm_shuffle_epi8 (_mm_packus_epi16 (apal, apal), idx);
+}
+
+VTF_TARGET("ssse3") static inline void
+vtf_dxt5_block_ssse3 (const uint8_t *src, guchar *dst, size_t stride)
+{
+    __m128i v = _mm_loadu_si128 ((const __m128i *) src);
+    __m128i pal = vtf_dxt_palette_sse2 (vtf_dxt_colors_sse2 (v, 1),
+                                        _mm_setzero_si128 (), _mm_set1_epi32 (-1));
+    __m128i alpha = vtf_dxt5_alpha_ssse3 (v);
+
+    __m128i rows[4];
+    for (int ii = 0; ii < 4; ii++)
+        rows[ii] = _mm_shuffle_epi8 (alpha, VTF_ALPHA_ROW_MASK (ii));
+
+    vtf_dxt_emit_sse2 (pal, _mm_shuffle_epi32 (v, 0xFF), rows, dst, stride);
+}
+
+VTF_TARGET("ssse3") static void
+vtf_dxt5_row_ssse3 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    for (uint k = 0; k < blocks; k++, src += 16, dst += 16)
+        vtf_dxt5_block_ssse3 (src, dst, stride);
+}
+
+VTF_TARGET("avx2") static inline __m256i
+vtf_dxt_palette_avx2 (__m256i c, __m256i alpha, __m256i four_only)
+{
+    const __m256i mask = _mm256_setr_epi16 (VTF_565_MASK, VTF_565_MASK);
+    const __m256i bias = _mm256_set1_epi16 ((short) 0x8000);
+
+    __m256i m  = _mm256_and_si256 (c, mask);
+    __m256i x  = _mm256_or_si256 (_mm256_or_si256 (
+                     _mm256_mulhi_epu16 (m, _mm256_setr_epi16 (VTF_565_SHR, VTF_565_SHR)),
+                     _mm256_mullo_epi16 (m, _mm256_setr_epi16 (VTF_565_SHL, VTF_565_SHL))),
+                     alpha);
+    __m256i xs = _mm256_shuffle_epi32 (x, 0x4E);
+
+    __m256i four = _mm256_add_epi16 (_mm256_add_epi16 (_mm256_slli_epi16 (x, 2), _mm256_slli_epi16 (xs, 1)),
+                                     _mm256_set1_epi16 (3));
+    four = _mm256_mulhi_epu16 (four, _mm256_set1_epi16 (VTF_DIV6));
+    __m256i three = _mm256_and_si256 (_mm256_avg_epu16 (x, xs),
+                                      _mm256_setr_epi32 (-1, -1, 0, 0, -1, -1, 0, 0));
+
+    __m256i gt = _mm256_cmpgt_epi16 (_mm256_xor_si256 (c, bias),
+                                     _mm256_xor_si256 (_mm256_shuffle_epi32 (c, 0x4E), bias));
+    gt = _mm256_or_si256 (_mm256_shuffle_epi32 (gt, 0x00), four_only);
+
+    return _mm256_packus_epi16 (x, _mm256_blendv_epi8 (three, four, gt));
+}
+
+// Two blocks per iteration; each output row is 8 pixels wide.
+VTF_TARGET("avx2") static inline void
+vtf_dxt_emit_avx2 (__m256i pal, __m256i sel, const __m256i *alpha, guchar *dst, size_t stride)
+{
+    const __m256i shift = _mm256_setr_epi32 (0, 2, 4, 6, 0, 2, 4, 6);
+    const __m256i base  = _mm256_setr_epi32 (0, 0, 0, 0, 4, 4, 4, 4);
+    const __m256i three = _mm256_set1_epi32 (3);
+
+    for (int ii = 0; ii < 4; ii++) {
+        __m256i idx = _mm256_add_epi32 (_mm256_and_si256 (_mm256_srlv_epi32 (sel, shift), three), base);
+        __m256i row = _mm256_permutevar8x32_epi32 (pal, idx);
+        if (alpha != NULL)
+            row = _mm256_or_si256 (row, alpha[ii]);
+        _mm256_storeu_si256 ((__m256i *) (dst + stride*ii), row);
+        sel = _mm256_srli_epi32 (sel, 8);
+    }
+}
+
+VTF_TARGET("avx2") static void
+vtf_dxt1_row_avx2 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    const __m256i spread = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_COLOR_LO));
+    const __m256i alpha = _mm256_setr_epi16 (VTF_565_ALPHA, VTF_565_ALPHA);
+    uint k = 0;
+
+    for (; k + 2 <= blocks; k += 2, src += 16, dst += 32) {
+        __m256i v = _mm256_permute4x64_epi64 (
+            _mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) src)), 0x50);
+        __m256i pal = vtf_dxt_palette_avx2 (_mm256_shuffle_epi8 (v, spread), alpha,
+                                            _mm256_setzero_si256 ());
+        vtf_dxt_emit_avx2 (pal, _mm256_shuffle_epi32 (v, 0x55), NULL, dst, stride);
+    }
+    // legacy-SSE encoded unless it happens to be inlined
+    if (k < blocks) {
+        _mm256_zeroupper ();
+        vtf_dxt1_block_sse2 (src, dst, stride);
+    }
+}
+
+VTF_TARGET("avx2") static void
+vtf_dxt3_row_avx2 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    const __m256i spread = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_COLOR_HI));
+    const __m256i nibble = _mm256_set1_epi8 (0x0F);
+    uint k = 0;
+
+    for (; k + 2 <= blocks; k += 2, src += 32, dst += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) src);
+        __m256i pal = vtf_dxt_palette_avx2 (_mm256_shuffle_epi8 (v, spread),
+                                            _mm256_setzero_si256 (), _mm256_set1_epi32 (-1));
+        __m256i alpha = _mm256_unpacklo_epi8 (_mm256_and_si256 (v, nibble),
+                                              _mm256_and_si256 (_mm256_srli_epi16 (v, 4), nibble));
+        alpha = _mm256_or_si256 (alpha, _mm256_slli_epi16 (alpha, 4));
+
+        __m256i rows[4];
+        for (int ii = 0; ii < 4; ii++)
+            rows[ii] = _mm256_shuffle_epi8 (alpha, _mm256_broadcastsi128_si256 (VTF_ALPHA_ROW_MASK (ii)));
+
+        vtf_dxt_emit_avx2 (pal, _mm256_shuffle_epi32 (v, 0xFF), rows, dst, stride);
+    }
+    if (k < blocks) {
+        _mm256_zeroupper ();
+        vtf_dxt3_block_sse2 (src, dst, stride);
+    }
+}
+
+VTF_TARGET("avx2") static inline __m256i
+vtf_dxt5_alpha_avx2 (__m256i v)
+{
+    const __m256i mul = _mm256_setr_epi16 (VTF_ALPHA_IDX_MUL, VTF_ALPHA_IDX_MUL);
+
+    __m256i lo = _mm256_shuffle_epi8 (v, _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_ALPHA_IDX_LO)));
+    __m256i hi = _mm256_shuffle_epi8 (v, _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_ALPHA_IDX_HI)));
+    lo = _mm256_srli_epi16 (_mm256_mullo_epi16 (lo, mul), 8);
+    hi = _mm256_srli_epi16 (_mm256_mullo_epi16 (hi, mul), 8);
+    __m256i idx = _mm256_and_si256 (_mm256_packus_epi16 (lo, hi), _mm256_set1_epi8 (7));
+
+    __m256i a0 = _mm256_shuffle_epi8 (v, _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_ALPHA_A0)));
+    __m256i a1 = _mm256_shuffle_epi8 (v, _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_ALPHA_A1)));
+
+    __m256i eight = _mm256_add_epi16 (_mm256_add_epi16 (
+                        _mm256_mullo_epi16 (a0, _mm256_setr_epi16 (VTF_ALPHA8_W0, VTF_ALPHA8_W0)),
+                        _mm256_mullo_epi16 (a1, _mm256_setr_epi16 (VTF_ALPHA8_W1, VTF_ALPHA8_W1))),
+                        _mm256_set1_epi16 (7));
+    __m256i six   = _mm256_add_epi16 (_mm256_add_epi16 (
+                        _mm256_mullo_epi16 (a0, _mm256_setr_epi16 (VTF_ALPHA6_W0, VTF_ALPHA6_W0)),
+                        _mm256_mullo_epi16 (a1, _mm256_setr_epi16 (VTF_ALPHA6_W1, VTF_ALPHA6_W1))),
+                        _mm256_set1_epi16 (5));
+
+    eight = _mm256_mulhi_epu16 (eight, _mm256_set1_epi16 (VTF_DIV14));
+    six   = _mm256_or_si256 (_mm256_mulhi_epu16 (six, _mm256_set1_epi16 (VTF_DIV10)),
+                             _mm256_setr_epi16 (VTF_ALPHA6_MAX, VTF_ALPHA6_MAX));
+    __m256i apal = _mm256_blendv_epi8 (six, eight, _mm256_cmpgt_epi16 (a0, a1));
+
+    return _mm256_shuffle_epi8 (_mm256_packus_epi16 (apal, apal), idx);
+}
+
+VTF_TARGET("avx2") static void
+vtf_dxt5_row_avx2 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    const __m256i spread = _mm256_broadcastsi128_si256 (_mm_setr_epi8 (VTF_COLOR_HI));
+    uint k = 0;
+
+    for (; k + 2 <= blocks; k += 2, src += 32, dst += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) src);
+        __m256i pal = vtf_dxt_palette_avx2 (_mm256_shuffle_epi8 (v, spread),
+                                            _mm256_setzero_si256 (), _mm256_set1_epi32 (-1));
+        __m256i alpha = vtf_dxt5_alpha_avx2 (v);
+
+        __m256i rows[4];
+        for (int ii = 0; ii < 4; ii++)
+            rows[ii] = _mm256_shuffle_epi8 (alpha, _mm256_broadcastsi128_si256 (VTF_ALPHA_ROW_MASK (ii)));
+
+        vtf_dxt_emit_avx2 (pal, _mm256_shuffle_epi32 (v, 0xFF), rows, dst, stride);
+    }
+    if (k < blocks) {
+        _mm256_zeroupper ();
+        vtf_dxt5_block_ssse3 (src, dst, stride);
+    }
+}
+
+#define VTF_BROADCAST512(...) _mm512_broadcast_i32x4 (_mm_setr_epi16 (__VA_ARGS__))
+#define VTF_BROADCAST512_8(...) _mm512_broadcast_i32x4 (_mm_setr_epi8 (__VA_ARGS__))
+
+VTF_TARGET("avx512f,avx512bw") static inline __m512i
+vtf_dxt_palette_avx512 (__m512i c, __m512i alpha, __m512i four_only)
+{
+    __m512i m  = _mm512_and_si512 (c, VTF_BROADCAST512 (VTF_565_MASK));
+    __m512i x  = _mm512_or_si512 (_mm512_or_si512 (
+                     _mm512_mulhi_epu16 (m, VTF_BROADCAST512 (VTF_565_SHR)),
+                     _mm512_mullo_epi16 (m, VTF_BROADCAST512 (VTF_565_SHL))),
+                     alpha);
+    __m512i xs = _mm512_shuffle_epi32 (x, (_MM_PERM_ENUM) 0x4E);
+
+    __m512i four = _mm512_add_epi16 (_mm512_add_epi16 (_mm512_slli_epi16 (x, 2), _mm512_slli_epi16 (xs, 1)),
+                                     _mm512_set1_epi16 (3));
+    four = _mm512_mulhi_epu16 (four, _mm512_set1_epi16 (VTF_DIV6));
+    __m512i three = _mm512_maskz_mov_epi64 (0x55, _mm512_avg_epu16 (x, xs));
+
+    __m512i gt = _mm512_movm_epi16 (_mm512_cmpgt_epu16_mask (c, _mm512_shuffle_epi32 (c, (_MM_PERM_ENUM) 0x4E)));
+    gt = _mm512_or_si512 (_mm512_shuffle_epi32 (gt, (_MM_PERM_ENUM) 0x00), four_only);
+
+    return _mm512_packus_epi16 (x, _mm512_ternarylogic_epi32 (gt, four, three, 0xCA));
+}
+
+// Four blocks per iteration; each output row is 16 pixels wide.
+VTF_TARGET("avx512f,avx512bw") static inline void
+vtf_dxt_emit_avx512 (__m512i pal, __m512i sel, const __m512i *alpha, guchar *dst, size_t stride)
+{
+    const __m512i shift = _mm512_broadcast_i32x4 (_mm_setr_epi32 (0, 2, 4, 6));
+    const __m512i base  = _mm512_setr_epi32 (0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    const __m512i three = _mm512_set1_epi32 (3);
+
+    for (int ii = 0; ii < 4; ii++) {
+        __m512i idx = _mm512_add_epi32 (_mm512_and_si512 (_mm512_srlv_epi32 (sel, shift), three), base);
+        __m512i row = _mm512_permutexvar_epi32 (idx, pal);
+        if (alpha != NULL)
+            row = _mm512_or_si512 (row, alpha[ii]);
+        _mm512_storeu_si512 ((void *) (dst + stride*ii), row);
+        sel = _mm512_srli_epi32 (sel, 8);
+    }
+}
+
+// Puts the 8-byte block k of a 32-byte load into both halves of lane k.
+VTF_TARGET("avx512f,avx512bw") static inline __m512i
+vtf_load_blocks8_avx512 (const uint8_t *src)
+{
+    return _mm512_permutexvar_epi64 (_mm512_setr_epi64 (0, 0, 1, 1, 2, 2, 3, 3),
+        _mm512_castsi256_si512 (_mm256_loadu_si256 ((const __m256i *) src)));
+}
+
+VTF_TARGET("avx512f,avx512bw") static void
+vtf_dxt1_row_avx512 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    const __m512i spread = VTF_BROADCAST512_8 (VTF_COLOR_LO);
+    const __m512i alpha = VTF_BROADCAST512 (VTF_565_ALPHA);
+    uint k = 0;
+
+    for (; k + 4 <= blocks; k += 4, src += 32, dst += 64) {
+        __m512i v = vtf_load_blocks8_avx512 (src);
+        __m512i pal = vtf_dxt_palette_avx512 (_mm512_shuffle_epi8 (v, spread), alpha,
+                                              _mm512_setzero_si512 ());
+        vtf_dxt_emit_avx512 (pal, _mm512_shuffle_epi32 (v, (_MM_PERM_ENUM) 0x55), NULL, dst, stride);
+    }
+    if (k < blocks)
+        vtf_dxt1_row_avx2 (src, dst, stride, blocks - k);
+}
+
+VTF_TARGET("avx512f,avx512bw") static void
+vtf_dxt3_row_avx512 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    const __m512i spread = VTF_BROADCAST512_8 (VTF_COLOR_HI);
+    const __m512i nibble = _mm512_set1_epi8 (0x0F);
+    uint k = 0;
+
+    for (; k + 4 <= blocks; k += 4, src += 64, dst += 64) {
+        __m512i v = _mm512_loadu_si512 ((const void *) src);
+        __m512i pal = vtf_dxt_palette_avx512 (_mm512_shuffle_epi8 (v, spread),
+                                              _mm512_setzero_si512 (), _mm512_set1_epi32 (-1));
+        __m512i alpha = _mm512_unpacklo_epi8 (_mm512_and_si512 (v, nibble),
+                                              _mm512_and_si512 (_mm512_srli_epi16 (v, 4), nibble));
+        alpha = _mm512_or_si512 (alpha, _mm512_slli_epi16 (alpha, 4));
+
+        __m512i rows[4];
+        for (int ii = 0; ii < 4; ii++)
+            rows[ii] = _mm512_shuffle_epi8 (alpha, _mm512_broadcast_i32x4 (VTF_ALPHA_ROW_MASK (ii)));
+
+        vtf_dxt_emit_avx512 (pal, _mm512_shuffle_epi32 (v, (_MM_PERM_ENUM) 0xFF), rows, dst, stride);
+    }
+    if (k < blocks)
+        vtf_dxt3_row_avx2 (src, dst, stride, blocks - k);
+}
+
+VTF_TARGET("avx512f,avx512bw") static inline __m512i
+vtf_dxt5_alpha_avx512 (__m512i v)
+{
+    const __m512i mul = VTF_BROADCAST512 (VTF_ALPHA_IDX_MUL);
+
+    __m512i lo = _mm512_shuffle_epi8 (v, VTF_BROADCAST512_8 (VTF_ALPHA_IDX_LO));
+    __m512i hi = _mm512_shuffle_epi8 (v, VTF_BROADCAST512_8 (VTF_ALPHA_IDX_HI));
+    lo = _mm512_srli_epi16 (_mm512_mullo_epi16 (lo, mul), 8);
+    hi = _mm512_srli_epi16 (_mm512_mullo_epi16 (hi, mul), 8);
+    __m512i idx = _mm512_and_si512 (_mm512_packus_epi16 (lo, hi), _mm512_set1_epi8 (7));
+
+    __m512i a0 = _mm512_shuffle_epi8 (v, VTF_BROADCAST512_8 (VTF_ALPHA_A0));
+    __m512i a1 = _mm512_shuffle_epi8 (v, VTF_BROADCAST512_8 (VTF_ALPHA_A1));
+
+    __m512i eight = _mm512_add_epi16 (_mm512_add_epi16 (
+                        _mm512_mullo_epi16 (a0, VTF_BROADCAST512 (VTF_ALPHA8_W0)),
+                        _mm512_mullo_epi16 (a1, VTF_BROADCAST512 (VTF_ALPHA8_W1))),
+                        _mm512_set1_epi16 (7));
+    __m512i six   = _mm512_add_epi16 (_mm512_add_epi16 (
+                        _mm512_mullo_epi16 (a0, VTF_BROADCAST512 (VTF_ALPHA6_W0)),
+                        _mm512_mullo_epi16 (a1, VTF_BROADCAST512 (VTF_ALPHA6_W1))),
+                        _mm512_set1_epi16 (5));
+
+    eight = _mm512_mulhi_epu16 (eight, _mm512_set1_epi16 (VTF_DIV14));
+    six   = _mm512_or_si512 (_mm512_mulhi_epu16 (six, _mm512_set1_epi16 (VTF_DIV10)),
+                             VTF_BROADCAST512 (VTF_ALPHA6_MAX));
+    __m512i apal = _mm512_mask_blend_epi16 (_mm512_cmpgt_epu16_mask (a0, a1), six, eight);
+
+    return _mm512_shuffle_epi8 (_mm512_packus_epi16 (apal, apal), idx);
+}
+
+VTF_TARGET("avx512f,avx512bw") static void
+vtf_dxt5_row_avx512 (const uint8_t *src, guchar *dst, size_t stride, uint blocks)
+{
+    const __m512i spread = VTF_BROADCAST512_8 (VTF_COLOR_HI);
+    uint k = 0;
+
+    for (; k + 4 <= blocks; k += 4, src += 64, dst += 64) {
+        __m512i v = _mm512_loadu_si512 ((const void *) src);
+        __m512i pal = vtf_dxt_palette_avx512 (_mm512_shuffle_epi8 (v, spread),
+                                              _mm512_setzero_si512 (), _mm512_set1_epi32 (-1));
+        __m512i alpha = vtf_dxt5_alpha_avx512 (v);
+
+        __m512i rows[4];
+        for (int ii = 0; ii < 4; ii++)
+            rows[ii] = _mm512_shuffle_epi8 (alpha, _mm512_broadcast_i32x4 (VTF_ALPHA_ROW_MASK (ii)));
+
+        vtf_dxt_emit_avx512 (pal, _mm512_shuffle_epi32 (v, (_MM_PERM_ENUM) 0xFF), rows, dst, stride);
+    }
+    if (k < blocks)
+        vtf_dxt5_row_avx2 (src, dst, stride, blocks - k);
+}
+
+// Shuffling needs pshufb; SSE2 machines use the scalar loop.
+#define vtf_swizzle_row_sse2 vtf_swizzle_row_scalar
+
+#define VTF_SWIZZLE_MASK(swizzle, r, q) _mm_load_si128 ((const __m128i *) (swizzle)->mask[r][q])
+
+/*
+ * A 3 bpp pixel never moves more than two bytes, so output vector 0 never
+ * reads input vector 2 and output vector 2 never reads input vector 0.
+ */
+VTF_TARGET("ssse3") static void
+vtf_swizzle_row_ssse3 (const VtfSwizzle *swizzle, const uint8_t *src, guchar *dst, uint width)
+{
+    uint j = 0;
+
+    if (swizzle->bpp == 4) {
+        const __m128i m = VTF_SWIZZLE_MASK (swizzle, 0, 0);
+
+        for (; j + 4 <= width; j += 4)
+            _mm_storeu_si128 ((__m128i *) (dst + 4*j),
+                _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (src + 4*j)), m));
+    } else {
+        const __m128i m00 = VTF_SWIZZLE_MASK (swizzle, 0, 0), m01 = VTF_SWIZZLE_MASK (swizzle, 0, 1);
+        const __m128i m10 = VTF_SWIZZLE_MASK (swizzle, 1, 0), m11 = VTF_SWIZZLE_MASK (swizzle, 1, 1);
+        const __m128i m12 = VTF_SWIZZLE_MASK (swizzle, 1, 2);
+        const __m128i m21 = VTF_SWIZZLE_MASK (swizzle, 2, 1), m22 = VTF_SWIZZLE_MASK (swizzle, 2, 2);
+
+        for (; j + 16 <= width; j += 16) {
+            const __m128i *in = (const __m128i *) (src + 3*j);
+            __m128i *out = (__m128i *) (dst + 3*j);
+            __m128i in0 = _mm_loadu_si128 (in);
+            __m128i in1 = _mm_loadu_si128 (in + 1);
+            __m128i in2 = _mm_loadu_si128 (in + 2);
+
+            _mm_storeu_si128 (out, _mm_or_si128 (_mm_shuffle_epi8 (in0, m00), _mm_shuffle_epi8 (in1, m01)));
+            _mm_storeu_si128 (out + 1, _mm_or_si128 (_mm_or_si128 (_mm_shuffle_epi8 (in0, m10),
+                _mm_shuffle_epi8 (in1, m11)), _mm_shuffle_epi8 (in2, m12)));
+            _mm_storeu_si128 (out + 2, _mm_or_si128 (_mm_shuffle_epi8 (in1, m21), _mm_shuffle_epi8 (in2, m22)));
+        }
+    }
+
+    vtf_swizzle_row_scalar(swizzle, src + swizzle->bpp*j, dst + swizzle->bpp*j, width - j);
+}
+
+VTF_TARGET("avx2") static inline __m256i
+vtf_load2_avx2 (const uint8_t *lo, const uint8_t *hi)
+{
+    return _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) lo)),
+                                    _mm_loadu_si128 ((const __m128i *) hi), 1);
+}
+
+VTF_TARGET("avx2") static inline void
+vtf_store2_avx2 (guchar *lo, guchar *hi, __m256i v)
+{
+    _mm_storeu_si128 ((__m128i *) lo, _mm256_castsi256_si128 (v));
+    _mm_storeu_si128 ((__m128i *) hi, _mm256_extracti128_si256 (v, 1));
+}
+
+// 3 bpp rows run two 48-byte chunks side by side, one per 128-bit lane.
+VTF_TARGET("avx2") static void
+vtf_swizzle_row_avx2 (const VtfSwizzle *swizzle, const uint8_t *src, guchar *dst, uint width)
+{
+    uint j = 0;
+
+    if (swizzle->bpp == 4) {
+        const __m256i m = _mm256_broadcastsi128_si256 (VTF_SWIZZLE_MASK (swizzle, 0, 0));
+
+        for (; j + 8 <= width; j += 8)
+            _mm256_storeu_si256 ((__m256i *) (dst + 4*j),
+                _mm256_shuffle_epi8 (_mm256_loadu_si256 ((const __m256i *) (src + 4*j)), m));
+    } else {
+#define VTF_SWIZZLE_MASK2(r, q) _mm256_broadcastsi128_si256 (VTF_SWIZZLE_MASK (swizzle, r, q))
+        const __m256i m00 = VTF_SWIZZLE_MASK2 (0, 0), m01 = VTF_SWIZZLE_MASK2 (0, 1);
+        const __m256i m10 = VTF_SWIZZLE_MASK2 (1, 0), m11 = VTF_SWIZZLE_MASK2 (1, 1);
+        const __m256i m12 = VTF_SWIZZLE_MASK2 (1, 2);
+        const __m256i m21 = VTF_SWIZZLE_MASK2 (2, 1), m22 = VTF_SWIZZLE_MASK2 (2, 2);
+#undef VTF_SWIZZLE_MASK2
+
+        for (; j + 32 <= width; j += 32) {
+            const uint8_t *in = src + 3*j;
+            guchar *out = dst + 3*j;
+            __m256i in0 = vtf_load2_avx2 (in, in + 48);
+            __m256i in1 = vtf_load2_avx2 (in + 16, in + 64);
+            __m256i in2 = vtf_load2_avx2 (in + 32, in + 80);
+
+            vtf_store2_avx2 (out, out + 48,
+                _mm256_or_si256 (_mm256_shuffle_epi8 (in0, m00), _mm256_shuffle_epi8 (in1, m01)));
+            vtf_store2_avx2 (out + 16, out + 64,
+                _mm256_or_si256 (_mm256_or_si256 (_mm256_shuffle_epi8 (in0, m10),
+                    _mm256_shuffle_epi8 (in1, m11)), _mm256_shuffle_epi8 (in2, m12)));
+            vtf_store2_avx2 (out + 32, out + 80,
+                _mm256_or_si256 (_mm256_shuffle_epi8 (in1, m21), _mm256_shuffle_epi8 (in2, m22)));
+        }
+    }
+
+    // The SSSE3 tail is legacy-SSE encoded, so the upper halves have to be
+    // clean before it runs. Every AVX2 and AVX-512 kernel with an SSE tail
+    // clears them itself rather than relying on the compiler's vzeroupper
+    // insertion.
+    _mm256_zeroupper();
+    vtf_swizzle_row_ssse3(swizzle, src + swizzle->bpp*j, dst + swizzle->bpp*j, width - j);
+}
+
+VTF_TARGET("avx512f,avx512bw") static void
+vtf_swizzle_row_avx512 (const VtfSwizzle *swizzle, const uint8_t *src, guchar *dst, uint width)
+{
+    uint j = 0;
+
+    if (swizzle->bpp == 4) {
+        const __m512i m = _mm512_broadcast_i32x4 (VTF_SWIZZLE_MASK (swizzle, 0, 0));
+
+        for (; j + 16 <= width; j += 16)
+            _mm512_storeu_si512 ((void *) (dst + 4*j),
+                _mm512_shuffle_epi8 (_mm512_loadu_si512 ((const void *) (src + 4*j)), m));
+    }
+
+    vtf_swizzle_row_avx2(swizzle, src + swizzle->bpp*j, dst + swizzle->bpp*j, width - j);
+}
+
+#define VTF_HDR_ALPHA_LANES  0, 0, 0, -1
+
+VTF_TARGET("sse2") static inline __m128
+vtf_tonemap_sse2 (__m128 v, __m128 alpha)
+{
+    const __m128 knee = _mm_set1_ps (VTF_HDR_KNEE), shoulder = _mm_set1_ps (1.0f - VTF_HDR_KNEE);
+
+    v = _mm_min_ps (_mm_max_ps (v, _mm_setzero_ps ()), _mm_set1_ps (VTF_HALF_MAX));
+    __m128 t = _mm_max_ps (_mm_sub_ps (v, knee), _mm_setzero_ps ());
+    __m128 c = _mm_add_ps (_mm_min_ps (v, knee),
+                           _mm_div_ps (_mm_mul_ps (shoulder, t), _mm_add_ps (t, shoulder)));
+    __m128 a = _mm_min_ps (v, _mm_set1_ps (1.0f));
+
+    return _mm_mul_ps (_mm_or_ps (_mm_and_ps (alpha, a), _mm_andnot_ps (alpha, c)), _mm_set1_ps (255.0f));
+}
+
+// Widens through the tables four pixels at a time, then tone maps in SSE2.
+VTF_TARGET("sse2") static void
+vtf_rgba16f_row_sse2 (const uint8_t *src, guchar *dst, uint width)
+{
+    const __m128 alpha = _mm_castsi128_ps (_mm_setr_epi32 (VTF_HDR_ALPHA_LANES));
+    float f[16] __attribute__((aligned(16)));
+    uint j = 0;
+
+    for (; j + 4 <= width; j += 4, src += 32, dst += 16) {
+        for (int k = 0; k < 16; k++)
+            f[k] = vtf_half_to_float(src[2*k] | src[2*k + 1] << 8);
+
+        __m128i p0 = _mm_cvtps_epi32 (vtf_tonemap_sse2 (_mm_load_ps (f), alpha));
+        __m128i p1 = _mm_cvtps_epi32 (vtf_tonemap_sse2 (_mm_load_ps (f + 4), alpha));
+        __m128i p2 = _mm_cvtps_epi32 (vtf_tonemap_sse2 (_mm_load_ps (f + 8), alpha));
+        __m128i p3 = _mm_cvtps_epi32 (vtf_tonemap_sse2 (_mm_load_ps (f + 12), alpha));
+
+        _mm_storeu_si128 ((__m128i *) dst,
+            _mm_packus_epi16 (_mm_packs_epi32 (p0, p1), _mm_packs_epi32 (p2, p3)));
+    }
+
+    vtf_rgba16f_row_scalar(src, dst, width - j);
+}
+
+#define vtf_rgba16f_row_ssse3 vtf_rgba16f_row_sse2
+
+VTF_TARGET("avx2,f16c") static inline __m256i
+vtf_rgba16f_avx2 (const uint8_t *src)
+{
+    const __m256 knee = _mm256_set1_ps (VTF_HDR_KNEE), shoulder = _mm256_set1_ps (1.0f - VTF_HDR_KNEE);
+    const __m256 alpha = _mm256_castsi256_ps (_mm256_setr_epi32 (VTF_HDR_ALPHA_LANES, VTF_HDR_ALPHA_LANES));
+
+    __m256 v = _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *) src));
+    v = _mm256_min_ps (_mm256_max_ps (v, _mm256_setzero_ps ()), _mm256_set1_ps (VTF_HALF_MAX));
+    __m256 t = _mm256_max_ps (_mm256_sub_ps (v, knee), _mm256_setzero_ps ());
+    __m256 c = _mm256_add_ps (_mm256_min_ps (v, knee),
+                              _mm256_div_ps (_mm256_mul_ps (shoulder, t), _mm256_add_ps (t, shoulder)));
+    __m256 a = _mm256_min_ps (v, _mm256_set1_ps (1.0f));
+
+    return _mm256_cvtps_epi32 (_mm256_mul_ps (_mm256_blendv_ps (c, a, alpha), _mm256_set1_ps (255.0f)));
+}
+
+// Eight pixels per iteration; the lane-wise packs interleave them, which
+// the final permute undoes.
+VTF_TARGET("avx2,f16c") static void
+vtf_rgba16f_row_avx2 (const uint8_t *src, guchar *dst, uint width)
+{
+    const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+    uint j = 0;
+
+    for (; j + 8 <= width; j += 8, src += 64, dst += 32) {
+        __m256i p01 = _mm256_packs_epi32 (vtf_rgba16f_avx2 (src), vtf_rgba16f_avx2 (src + 16));
+        __m256i p23 = _mm256_packs_epi32 (vtf_rgba16f_avx2 (src + 32), vtf_rgba16f_avx2 (src + 48));
+
+        _mm256_storeu_si256 ((__m256i *) dst,
+            _mm256_permutevar8x32_epi32 (_mm256_packus_epi16 (p01, p23), order));
+    }
+
+    _mm256_zeroupper ();
+    vtf_rgba16f_row_scalar(src, dst, width - j);
+}
+
+VTF_TARGET("avx512f,avx512bw") static inline __m512i
+vtf_rgba16f_avx512 (const uint8_t *src)
+{
+    const __m512 knee = _mm512_set1_ps (VTF_HDR_KNEE), shoulder = _mm512_set1_ps (1.0f - VTF_HDR_KNEE);
+
+    __m512 v = _mm512_cvtph_ps (_mm256_loadu_si256 ((const __m256i *) src));
+    v = _mm512_min_ps (_mm512_max_ps (v, _mm512_setzero_ps ()), _mm512_set1_ps (VTF_HALF_MAX));
+    __m512 t = _mm512_max_ps (_mm512_sub_ps (v, knee), _mm512_setzero_ps ());
+    __m512 c = _mm512_add_ps (_mm512_min_ps (v, knee),
+                              _mm512_div_ps (_mm512_mul_ps (shoulder, t), _mm512_add_ps (t, shoulder)));
+    __m512 a = _mm512_min_ps (v, _mm512_set1_ps (1.0f));
+
+    return _mm512_cvtps_epi32 (_mm512_mul_ps (_mm512_mask_blend_ps (0x8888, c, a), _mm512_set1_ps (255.0f)));
+}
+
+VTF_TARGET("avx512f,avx512bw") static void
+vtf_rgba16f_row_avx512 (const uint8_t *src, guchar *dst, uint width)
+{
+    const __m512i order = _mm512_setr_epi32 (0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    uint j = 0;
+
+    for (; j + 16 <= width; j += 16, src += 128, dst += 64) {
+        __m512i p01 = _mm512_packs_epi32 (vtf_rgba16f_avx512 (src), vtf_rgba16f_avx512 (src + 32));
+        __m512i p23 = _mm512_packs_epi32 (vtf_rgba16f_avx512 (src + 64), vtf_rgba16f_avx512 (src + 96));
+
+        _mm512_storeu_si512 ((void *) dst,
+            _mm512_permutexvar_epi32 (order, _mm512_packus_epi16 (p01, p23)));
+    }
+
+    vtf_rgba16f_row_avx2(src, dst, width - j);
+}
+
+/*
+ * 16-bit narrowing kernels. A bias row covers four pixels, one 256-bit
+ * vector of 16-bit lanes; remainders go to the next level down, starting
+ * on a multiple of four pixels so the bias stays in phase.
+ */
+
+VTF_TARGET("sse2") static void
+vtf_rgba16_narrow_sse2 (const uint8_t *src, guchar *dst, uint width, const uint16_t *bias)
+{
+    const __m128i scale = _mm_set1_epi16((short)0xff01);
+    const __m128i bias_lo = _mm_load_si128((const __m128i *)bias);
+    const __m128i bias_hi = _mm_load_si128((const __m128i *)(bias + 8));
+    uint j = 0;
+
+    for (; j + 4 <= width; j += 4, src += 32, dst += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)src);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + 16));
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_mulhi_epu16(lo, scale), bias_lo), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_mulhi_epu16(hi, scale), bias_hi), 8);
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+    }
+
+    vtf_rgba16_narrow_scalar(src, dst, width - j, bias);
+}
+
+VTF_TARGET("avx2") static void
+vtf_rgba16_narrow_avx2 (const uint8_t *src, guchar *dst, uint width, const uint16_t *bias)
+{
+    const __m256i scale = _mm256_set1_epi16((short)0xff01);
+    const __m256i offset = _mm256_load_si256((const __m256i *)bias);
+    uint j = 0;
+
+    for (; j + 8 <= width; j += 8, src += 64, dst += 32) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)src);
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(src + 32));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mulhi_epu16(lo, scale), offset), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mulhi_epu16(hi, scale), offset), 8);
+        // packus works within 128-bit lanes
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)dst, packed);
+    }
+
+    // The SSE2 kernel is not VEX encoded, so the upper halves are cleared
+    // before the tail instead of leaving it to the compiler. The AVX-512
+    // kernel reaches that tail through here as well.
+    _mm256_zeroupper();
+    vtf_rgba16_narrow_sse2(src, dst, width - j, bias);
+}
+
+VTF_TARGET("avx512f,avx512bw") static void
+vtf_rgba16_narrow_avx512 (const uint8_t *src, guchar *dst, uint width, const uint16_t *bias)
+{
+    const __m512i scale = _mm512_set1_epi16((short)0xff01);
+    const __m512i offset = _mm512_broadcast_i64x4(_mm256_load_si256((const __m256i *)bias));
+    const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+    uint j = 0;
+
+    for (; j + 16 <= width; j += 16, src += 128, dst += 64) {
+        __m512i lo = _mm512_loadu_si512((const void *)src);
+        __m512i hi = _mm512_loadu_si512((const void *)(src + 64));
+        lo = _mm512_srli_epi16(_mm512_add_epi16(_mm512_mulhi_epu16(lo, scale), offset), 8);
+        hi = _mm512_srli_epi16(_mm512_add_epi16(_mm512_mulhi_epu16(hi, scale), offset), 8);
+        __m512i packed = _mm512_permutexvar_epi64(order, _mm512_packus_epi16(lo, hi));
+        _mm512_storeu_si512((void *)dst, packed);
+    }
+
+    vtf_rgba16_narrow_avx2(src, dst, width - j, bias);
+}
+
+#define vtf_rgba16_narrow_ssse3 vtf_rgba16_narrow_sse2
+
+VTF_TARGET("sse2") VTF_NARROW_ROWS (sse2)
+VTF_TARGET("ssse3") VTF_NARROW_ROWS (ssse3)
+VTF_TARGET("avx2") VTF_NARROW_ROWS (avx2)
+VTF_TARGET("avx512f,avx512bw") VTF_NARROW_ROWS (avx512)
+
+/*
+ * Streaming copies
+ *
+ * Move decoded rows from a cache-resident scratch strip into a pixbuf that
+ * is larger than the last level cache. Non-temporal stores write whole
+ * lines without reading them for ownership first, and keep the pixbuf from
+ * evicting the source data and the decoder's tables.
+ */
+
+#define VTF_STREAM_COPY(isa, type, bytes, load, store) \
+    static void \
+    vtf_stream_copy_##isa (guchar *dst, const uint8_t *src, size_t size) \
+    { \
+        size_t head = MIN(-(uintptr_t)dst & (bytes - 1), size); \
+        memcpy(dst, src, head); \
+        for (dst += head, src += head, size -= head; size >= bytes; \
+             dst += bytes, src += bytes, size -= bytes) \
+            store((type *)dst, load((const type *)src)); \
+        memcpy(dst, src, size); \
+        _mm_sfence(); \
+    }
+
+VTF_TARGET("sse2") VTF_STREAM_COPY (sse2, __m128i, 16, _mm_loadu_si128, _mm_stream_si128)
+VTF_TARGET("avx2") VTF_STREAM_COPY (avx2, __m256i, 32, _mm256_loadu_si256, _mm256_stream_si256)
+VTF_TARGET("avx512f,avx512bw") VTF_STREAM_COPY (avx512, __m512i, 64, _mm512_loadu_si512, _mm512_stream_si512)
+
+#endif /* VTF_X86 */
+
+static const char * const vtf_isa_names[VTF_ISA_COUNT] = {
+    "scalar", "sse2", "ssse3", "avx2", "avx512"
+};
+
+static VtfIsa
+vtf_detect_isa (void)
+{
+#ifdef VTF_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw"))
+        return VTF_ISA_AVX512;
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("f16c"))
+        return VTF_ISA_AVX2;
+    if (__builtin_cpu_supports ("ssse3"))
+        return VTF_ISA_SSSE3;
+    if (__builtin_cpu_supports ("sse2"))
+        return VTF_ISA_SSE2;
+#endif
+    return VTF_ISA_SCALAR;
+}
+
+#ifdef VTF_X86
+#define VTF_KERNELS(name) { name##_scalar, name##_sse2, name##_ssse3, name##_avx2, name##_avx512 }
+#else
+#define VTF_KERNELS(name) { name##_scalar, name##_scalar, name##_scalar, name##_scalar, name##_scalar }
+#endif
+
+/*
+ * Format descriptors
+ *
+ * Indexed by high resolution image format. Swizzled formats get their own
+ * row kernels, with the swizzle bound in, so that every per-pixel format
+ * goes through the same VtfPixelFunc interface. Formats without an entry
+ * (P8, the bluescreen formats, BGRX8888, BGR565, BGRX5551, BGRA4444,
+ * DXT1_ONEBITALPHA, BGRA5551, UV88, UVWQ8888, UVLX8888) are not supported
+ * yet.
+ */
+
+#define VTF_SWIZZLE_CLONE(name, format, isa) \
+    static void name##_##isa (const uint8_t *src, guchar *dst, uint width) \
+    { vtf_swizzle_row_##isa(&vtf_swizzles[format], src, dst, width); }
+
+#ifdef VTF_X86
+#define VTF_SWIZZLE_KERNEL(name, format) \
+    VTF_SWIZZLE_CLONE(name, format, scalar) \
+    VTF_SWIZZLE_CLONE(name, format, sse2) \
+    VTF_SWIZZLE_CLONE(name, format, ssse3) \
+    VTF_SWIZZLE_CLONE(name, format, avx2) \
+    VTF_SWIZZLE_CLONE(name, format, avx512)
+#else
+#define VTF_SWIZZLE_KERNEL(name, format) VTF_SWIZZLE_CLONE(name, format, scalar)
+#endif
+
+VTF_SWIZZLE_KERNEL (vtf_abgr8888_row, IMAGE_FORMAT_ABGR8888)
+VTF_SWIZZLE_KERNEL (vtf_rgb888_row,   IMAGE_FORMAT_RGB888)
+VTF_SWIZZLE_KERNEL (vtf_bgr888_row,   IMAGE_FORMAT_BGR888)
+VTF_SWIZZLE_KERNEL (vtf_argb8888_row, IMAGE_FORMAT_ARGB8888)
+VTF_SWIZZLE_KERNEL (vtf_bgra8888_row, IMAGE_FORMAT_BGRA8888)
+
+typedef struct
+{
+    uint         block;                         // Block edge in pixels, 1 for per-pixel formats.
+    uint         block_bytes;                   // Bytes per block, or per pixel.
+    uint         channels;                      // Pixbuf channels; 4 means it has alpha.
+    VtfRowFunc   block_rows[VTF_ISA_COUNT];     // Kernels of block formats...
+    VtfPixelFunc pixel_rows[VTF_ISA_COUNT];     // ...or of per-pixel formats.
+    VtfDitherFunc dither_rows[VTF_ISA_COUNT];   // Optional dithering pixel kernels.
+} VtfFormat;
+
+#define VTF_BLOCK_FORMAT(bytes, name)           { 4, bytes, 4, VTF_KERNELS (name), { NULL } }
+#define VTF_PIXEL_FORMAT(bytes, channels, name) { 1, bytes, channels, { NULL }, VTF_KERNELS (name) }
+
+static const VtfFormat vtf_formats[] = {
+    [IMAGE_FORMAT_RGBA8888]      = VTF_PIXEL_FORMAT (4, 4, vtf_rgba8888_row),
+    [IMAGE_FORMAT_ABGR8888]      = VTF_PIXEL_FORMAT (4, 4, vtf_abgr8888_row),
+    [IMAGE_FORMAT_RGB888]        = VTF_PIXEL_FORMAT (3, 3, vtf_rgb888_row),
+    [IMAGE_FORMAT_BGR888]        = VTF_PIXEL_FORMAT (3, 3, vtf_bgr888_row),
+    [IMAGE_FORMAT_RGB565]        = VTF_PIXEL_FORMAT (2, 3, vtf_rgb565_row),
+    [IMAGE_FORMAT_I8]            = VTF_PIXEL_FORMAT (1, 3, vtf_i8_row),
+    [IMAGE_FORMAT_IA88]          = VTF_PIXEL_FORMAT (2, 4, vtf_ia88_row),
+    [IMAGE_FORMAT_A8]            = VTF_PIXEL_FORMAT (1, 4, vtf_a8_row),
+    [IMAGE_FORMAT_ARGB8888]      = VTF_PIXEL_FORMAT (4, 4, vtf_argb8888_row),
+    [IMAGE_FORMAT_BGRA8888]      = VTF_PIXEL_FORMAT (4, 4, vtf_bgra8888_row),
+    [IMAGE_FORMAT_DXT1]          = VTF_BLOCK_FORMAT (8, vtf_dxt1_row),
+    [IMAGE_FORMAT_DXT3]          = VTF_BLOCK_FORMAT (16, vtf_dxt3_row),
+    [IMAGE_FORMAT_DXT5]          = VTF_BLOCK_FORMAT (16, vtf_dxt5_row),
+    [IMAGE_FORMAT_RGBA16161616F] = VTF_PIXEL_FORMAT (8, 4, vtf_rgba16f_row),
+    [IMAGE_FORMAT_RGBA16161616]  = { 1, 8, 4, { NULL }, VTF_KERNELS (vtf_rgba16_row),
+                                     VTF_KERNELS (vtf_rgba16_dither_row) },
+};
+
+static const VtfFormat *
+vtf_find_format (uint32_t image_format)
+{
+    if (image_format >= G_N_ELEMENTS(vtf_formats) || vtf_formats[image_format].block == 0)
+        return NULL;
+    return &vtf_formats[image_format];
+}
+
+static size_t frame_size(uint32_t image_format, uint16_t width, uint16_t height) {
+    const VtfFormat *format = vtf_find_format(image_format);
+
+    if (image_format == (uint32_t)IMAGE_FORMAT_NONE)
+        return 0;
+    // not yet supported or illegal value
+    if (format == NULL)
+        return SIZE_MAX;
+
+    size_t columns = (width + format->block - 1) / format->block;
+    size_t rows = (height + format->block - 1) / format->block;
+    return columns * rows * format->block_bytes;
+}
+
+// The scalar level has no non-temporal stores, and SSSE3 adds none.
+#ifdef VTF_X86
+static const VtfCopyFunc vtf_stream_copies[VTF_ISA_COUNT] = {
+    NULL, vtf_stream_copy_sse2, vtf_stream_copy_sse2, vtf_stream_copy_avx2, vtf_stream_copy_avx512
+};
+#else
+static const VtfCopyFunc vtf_stream_copies[VTF_ISA_COUNT] = { NULL };
+#endif
+
+// Pixbufs at least this large are written with streaming stores.
+#define VTF_STREAM_THRESHOLD (32 << 20)
+
+static VtfIsa vtf_isa = VTF_ISA_SCALAR;
+static gboolean vtf_dither = FALSE;
+
+// Default limits on what one load may take: pixels in a frame of the mip
+// decoded, frames, and bytes of file data kept plus frames decoded.
+#define VTF_MAX_PIXELS ((guint64)1 << 28)
+#define VTF_MAX_FRAMES G_MAXUINT16
+#define VTF_MAX_BYTES  ((guint64)1 << 31)
+
+static guint64 vtf_max_pixels = VTF_MAX_PIXELS;
+static guint64 vtf_max_frames = VTF_MAX_FRAMES;
+static guint64 vtf_max_bytes = VTF_MAX_BYTES;
+
+/*
+ * Picks the kernel level once, at module load. GDK_PIXBUF_VTF_ISA can name
+ * a lower level (scalar, sse2, ssse3, avx2, avx512) for benchmarking and
+ * bisecting; levels the CPU does not support are ignored.
+ * GDK_PIXBUF_VTF_DITHER=1 selects the dithering kernels where a format
+ * has them.
+ */
+static void
+vtf_init_kernels (void)
+{
+    const char *forced = g_getenv("GDK_PIXBUF_VTF_ISA");
+    const char *dither = g_getenv("GDK_PIXBUF_VTF_DITHER");
+
+    vtf_isa = vtf_detect_isa ();
+    if (forced != NULL) {
+        for (uint i = 0; i < VTF_ISA_COUNT; i++)
+            if (g_ascii_strcasecmp(forced, vtf_isa_names[i]) == 0 && i < vtf_isa)
+                vtf_isa = i;
+    }
+
+    vtf_dither = dither != NULL && g_strcmp0(dither, "0") != 0;
+
+    vtf_half_init ();
+    vtf_rgba16_init ();
+
+    for (size_t i = 0; i < G_N_ELEMENTS(vtf_swizzles); i++)
+        if (vtf_swizzles[i].bpp != 0)
+            vtf_swizzle_init(&vtf_swizzles[i]);
+}
+
+static void
+vtf_read_limit (const char *name, guint64 *limit)
+{
+    const char *value = g_getenv(name);
+    char *end;
+
+    if (value == NULL)
+        return;
+
+    guint64 n = g_ascii_strtoull(value, &end, 10);
+    if (end != value && *end == '\0')
+        *limit = n;
+}
+
+/*
+ * GDK_PIXBUF_VTF_MAX_PIXELS, GDK_PIXBUF_VTF_MAX_FRAMES and
+ * GDK_PIXBUF_VTF_MAX_BYTES override the default limits, so that services
+ * that open untrusted files can bound the memory and time of a load.
+ */
+static void
+vtf_init_limits (void)
+{
+    vtf_read_limit("GDK_PIXBUF_VTF_MAX_PIXELS", &vtf_max_pixels);
+    vtf_read_limit("GDK_PIXBUF_VTF_MAX_FRAMES", &vtf_max_frames);
+    vtf_read_limit("GDK_PIXBUF_VTF_MAX_BYTES", &vtf_max_bytes);
+}
+
+// Converts a surface row by row, with the dithering kernel when one is
+// given. With a stream copy each row goes through a scratch row instead of
+// being written to the pixbuf directly.
+static void
+vtf_convert_image (VtfPixelFunc row, VtfDitherFunc dither, VtfCopyFunc stream,
+                   uint bpp, uint channels, const uint8_t *src,
+                   guchar *pixels, uint32_t stride, uint width, uint height)
+{
+    guchar *scratch = stream != NULL ? g_malloc((size_t)width * channels) : NULL;
+
+    for (uint i = 0; i < height; i++, src += width * bpp, pixels += stride) {
+        guchar *out = stream != NULL ? scratch : pixels;
+
+        if (dither != NULL)
+            dither(src, out, width, i);
+        else
+            row(src, out, width);
+        if (stream != NULL)
+            stream(pixels, scratch, (size_t)width * channels);
+    }
+
+    g_free(scratch);
+}
+
+// Decodes a whole block-compressed surface, clipping blocks that
+// hang over the right or bottom edge (mips smaller than 4x4).
+// With a stream copy every block row goes through the scratch strip.
+static void
+vtf_decode_blocks (VtfRowFunc row, VtfCopyFunc stream, uint block_bytes, const uint8_t *src,
+                   guchar *pixels, uint32_t stride, uint width, uint height)
+{
+    uint blocks = (width + 3) / 4;
+    guchar *scratch = NULL;
+
+    for (uint i = 0; i < height; i += 4) {
+        if (stream == NULL && i + 4 <= height && width % 4 == 0) {
+            row(src, pixels + (size_t)stride*i, stride, blocks);
+        } else {
+            if (scratch == NULL)
+                scratch = g_malloc(blocks * 64);
+            row(src, scratch, blocks * 16, blocks);
+            for (uint ii = 0; ii < 4 && i + ii < height; ii++) {
+                if (stream != NULL)
+                    stream(pixels + (size_t)stride*(i+ii), scratch + blocks*16*ii, width * 4);
+                else
+                    memcpy(pixels + (size_t)stride*(i+ii), scratch + blocks*16*ii, width * 4);
+            }
+        }
+        src += blocks * block_bytes;
+    }
+
+    g_free(scratch);
+}
+
+// Whether a whole surface is large enough to be written with streaming
+// stores. It is decided for the surface, not for each part of it that is
+// decoded, since the incremental loader decodes a few rows at a time.
+static gboolean
+vtf_streaming (uint32_t stride, uint height)
+{
+    return (size_t)stride * height >= VTF_STREAM_THRESHOLD;
+}
+
+static void
+vtf_decode_image (const VtfFormat *format, VtfIsa isa, const uint8_t *src,
+                  guchar *pixels, uint32_t stride, uint width, uint height,
+                  gboolean streaming)
+{
+    VtfCopyFunc stream = streaming ? vtf_stream_copies[isa] : NULL;
+
+    if (format->block > 1)
+        vtf_decode_blocks(format->block_rows[isa], stream, format->block_bytes, src,
+            pixels, stride, width, height);
+    else
+        vtf_convert_image(format->pixel_rows[isa], vtf_dither ? format->dither_rows[isa] : NULL,
+            stream, format->block_bytes, format->channels, src, pixels, stride, width, height);
+}
+
+static uint16_t
+vtf_read_u16 (const guchar *data)
+{
+    return data[0] | data[1] << 8;
+}
+
+static uint32_t
+vtf_read_u32 (const guchar *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static float
+vtf_read_float (const guchar *data)
+{
+    uint32_t bits = vtf_read_u32(data);
+    float value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static gboolean
+vtf_version_at_least (const VtfHeader *header, uint32_t major, uint32_t minor)
+{
+    return header->version[0] > major || (header->version[0] == major && header->version[1] >= minor);
+}
+
+// How many bytes of header vtf_parse_header needs, given the first size
+// bytes of it; until that can be told, how many are needed to tell.
+static gsize
+vtf_header_length (const guchar *data, gsize size)
+{
+    if (size < 12)
+        return 12;
+
+    uint32_t major = vtf_read_u32(data + 4), minor = vtf_read_u32(data + 8);
+
+    if (major > 7 || (major == 7 && minor >= 3)) {
+        if (size < VTF_73_HEADER_SIZE)
+            return VTF_73_HEADER_SIZE;
+        return VTF_RESOURCES_OFFSET +
+            MIN(vtf_read_u32(data + 68), VTF_MAX_RESOURCES) * VTF_RESOURCE_HEADER_SIZE;
+    }
+    if (major == 7 && minor == 2)
+        return VTF_71_HEADER_SIZE;      // up to and including depth
+    return VTF_70_HEADER_SIZE;
+}
+
+// Records an entry of the resource directory. Only where the data is gets
+// noted, so that the loader can go straight to the parts it needs.
+static void
+vtf_parse_resource (VtfHeader *header, const guchar *entry)
+{
+    uint32_t tag = entry[0] | entry[1] << 8 | entry[2] << 16;
+    uint32_t data = vtf_read_u32(entry + 4);
+
+    if (entry[3] & VTF_RESOURCE_NO_DATA) {
+        if (tag == VTF_RESOURCE_CRC) {
+            header->crc = data;
+            header->hasCrc = TRUE;
+        } else if (tag == VTF_RESOURCE_LOD) {
+            header->lodClampU = data & 0xff;
+            header->lodClampV = data >> 8 & 0xff;
+        }
+        return;
+    }
+
+    switch (tag) {
+    case VTF_RESOURCE_LOWRES:
+        header->lowResOffset = data;
+        break;
+    case VTF_RESOURCE_HIGHRES:
+        header->highResOffset = data;
+        break;
+    case VTF_RESOURCE_SHEET:
+        header->sheetOffset = data;
+        break;
+    case VTF_RESOURCE_KVD:
+        header->keyValuesOffset = data;
+        break;
+    }
+}
+
+// Reads the header at the start of the file field by field, since the file
+// layout is packed and little endian. data holds the size bytes read so far,
+// at least vtf_header_length of them. Returns FALSE if it is not a VTF
+// header.
+static gboolean
+vtf_parse_header (VtfHeader *header, const guchar *data, gsize size)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->signature, data, 4);
+    header->version[0]         = vtf_read_u32(data + 4);
+    header->version[1]         = vtf_read_u32(data + 8);
+    header->headerSize         = vtf_read_u32(data + 12);
+    header->width              = vtf_read_u16(data + 16);
+    header->height             = vtf_read_u16(data + 18);
+    header->flags              = vtf_read_u32(data + 20);
+    header->frames             = vtf_read_u16(data + 24);
+    header->firstFrame         = vtf_read_u16(data + 26);
+    header->reflectivity[0]    = vtf_read_float(data + 32);
+    header->reflectivity[1]    = vtf_read_float(data + 36);
+    header->reflectivity[2]    = vtf_read_float(data + 40);
+    header->bumpmapScale       = vtf_read_float(data + 48);
+    header->highResImageFormat = vtf_read_u32(data + 52);
+    header->mipmapCount        = data[56];
+    header->lowResImageFormat  = vtf_read_u32(data + 57);
+    header->lowResImageWidth   = data[61];
+    header->lowResImageHeight  = data[62];
+    header->depth              = 1;
+
+    if (vtf_version_at_least(header, 7, 2))
+        header->depth = vtf_read_u16(data + 63);
+
+    if (vtf_version_at_least(header, 7, 3)) {
+        header->resources = vtf_read_u32(data + 68);
+        if (header->resources > VTF_MAX_RESOURCES)
+            return FALSE;
+
+        for (uint i = 0; i < header->resources; i++)
+            vtf_parse_resource(header, data + VTF_RESOURCES_OFFSET + i * VTF_RESOURCE_HEADER_SIZE);
+    }
+
+    if(header->signature[0] != 'V' || header->signature[1] != 'T' || header->signature[2] != 'F' || header->signature[3] != 0 || header->frames == 0)
+        return FALSE;
+
+    // the image data can't start inside the header
+    if (header->headerSize < vtf_header_length(data, size))
+        return FALSE;
+    if ((header->lowResOffset != 0 && header->lowResOffset < header->headerSize) ||
+        (header->highResOffset != 0 && header->highResOffset < header->headerSize))
+        return FALSE;
+
+    // every mip past the 1x1x1 one would shift the sizes out of range
+    if (header->mipmapCount > g_bit_storage(MAX(MAX(header->width, header->height), header->depth)))
+        return FALSE;
+
+    return TRUE;
+}
+
+static gpointer
+gdk_pixbuf__vtf_image_begin_load (GdkPixbufModuleSizeFunc size_func,
+                                  GdkPixbufModulePreparedFunc prepared_func,
+                                  GdkPixbufModuleUpdatedFunc updated_func,
+                                  gpointer user_data,
+                                  GError **error)
+{
+    VtfContext* context = g_malloc(sizeof(VtfContext));
+    if (context == NULL) {
+    	g_set_error (
+    		error,
+    		GDK_PIXBUF_ERROR,
+    		GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+    		("Not enough memory"));
+    	return NULL;
+    }
+    
+    context->size_func = size_func;
+    context->prepared_func = prepared_func;
+    context->updated_func = updated_func;
+    context->user_data = user_data;
+    
+    context->buffer_size = 0;
+    context->buffer = NULL;
+    context->buffer_data_size = 0;
+    context->expected_size = 0;
+    context->ranges[0] = (VtfRange){ 0, G_MAXUINT, 0 };
+    context->range_count = 1;
+    context->file_pos = 0;
+    context->bytes = NULL;
+    context->mapped = FALSE;
+    context->header_parsed = FALSE;
+    context->stopped = FALSE;
+    context->thumbnail = FALSE;
+    context->anim = NULL;
+    context->first = NULL;
+    context->rows_done = 0;
+    context->frame = 0;
+    
+    return (gpointer) context;
+}
+
+static uint
+vtf_mip_size(VtfHeader *header, uint mipLevel, uint depth) {
+    uint mipWidth  = header->width  >> mipLevel;
+    uint mipHeight = header->height >> mipLevel;
+    uint mipDepth  = depth          >> mipLevel;
+
+    if (mipWidth < 1) mipWidth = 1;
+    if (mipHeight < 1) mipHeight = 1;
+    if (mipDepth < 1) mipDepth = 1;
+
+    return frame_size(header->highResImageFormat, mipWidth, mipHeight) * mipDepth;
+}
+
+// Offset of a slice from the start of the image data. The size of the
+// whole image data is the offset of the mip 0 of frame header->frames.
+static uint
+vtf_offset(VtfHeader *header, uint frame, uint face, uint slice, uint mipLevel)
+{
+    uint offset = 0;
+    uint facecount = 1;
+
+    for (uint i = mipLevel + 1; i < header->mipmapCount; i++)
+        offset += vtf_mip_size (header, i, header->depth);
+
+    offset *= header->frames * facecount;
+
+    uint volume_bytes = vtf_mip_size (header, mipLevel, header->depth);
+    uint slice_bytes  = vtf_mip_size (header, mipLevel, 1);
+
+    offset += volume_bytes * (frame * facecount + face);
+    offset += slice_bytes  * slice;
+
+    return offset;
+}
+
+// The smallest stored mip that is still at least as large as requested.
+static uint
+vtf_pick_mip (const VtfHeader *header, gint width, gint height)
+{
+    uint level = 0;
+
+    while (level + 1 < header->mipmapCount &&
+           (gint)(header->width >> (level + 1)) >= width &&
+           (gint)(header->height >> (level + 1)) >= height)
+        level++;
+
+    return level;
+}
+
+// Whether RGBA8888 frames in bytes are referenced rather than copied.
+static gboolean
+vtf_frame_in_place (uint32_t image_format, GBytes *bytes)
+{
+#if GDK_PIXBUF_CHECK_VERSION(2, 32, 0)
+    return bytes != NULL && image_format == IMAGE_FORMAT_RGBA8888;
+#else
+    (void)image_format;
+    (void)bytes;
+    return FALSE;
+#endif
+}
+
+// Decodes a frame into a new pixbuf.
+static GdkPixbuf*
+gdk_pixbuf__vtf_load_frame (uint32_t image_format, GBytes *bytes, const guchar *src,
+                            uint width, uint height, GError **error) {
+    GdkPixbuf* pixbuf;
+
+    const VtfFormat *format = vtf_find_format(image_format);
+
+    if (format == NULL)
+        goto unsupported;
+
+#if GDK_PIXBUF_CHECK_VERSION(2, 32, 0)
+    // Already in gdk-pixbuf's layout (a 4 channel pixbuf has no row padding),
+    // so the pixbuf can reference the file data instead of copying it, if
+    // src lies in bytes.
+    if(vtf_frame_in_place(image_format, bytes)) {
+        gsize size = (gsize)width * height * 4;
+        gsize offset = src - (const guchar *)g_bytes_get_data(bytes, NULL);
+        GBytes *frame = g_bytes_new_from_bytes(bytes, offset, size);
+        pixbuf = gdk_pixbuf_new_from_bytes(frame, GDK_COLORSPACE_RGB, TRUE, 8,
+            width, height, width * 4);
+        g_bytes_unref(frame);
+        if (pixbuf == NULL) {
+            goto pixbufallocerror;
+        }
+        return pixbuf;
+    }
+#endif
+
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, format->channels == 4, 8, width, height);
+    if (pixbuf == NULL) {
+        goto pixbufallocerror;
+    }
+    vtf_decode_image(format, vtf_isa, src,
+        gdk_pixbuf_get_pixels(pixbuf), gdk_pixbuf_get_rowstride(pixbuf),
+        width, height, vtf_streaming(gdk_pixbuf_get_rowstride(pixbuf), height));
+
+    return pixbuf;
+
+pixbufallocerror:
+    g_set_error (
+        error,
+        GDK_PIXBUF_ERROR,
+        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+        "Could not allocate pixbuf object");
+    return NULL;
+
+unsupported:
+    /*fprintf(stderr,"Unsupported VTF format - version %u.%u, lowres format %u, highres format %u.\n",
+        header->version[0], header->version[1], header->lowResImageFormat, header->highResImageFormat);*/
+    g_set_error (
+        error,
+        GDK_PIXBUF_ERROR,
+        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+        "Can't read this yet.");
+    return NULL;
+}
+
+// Where the low-res image starts, or 0 if there is none.
+static uint
+vtf_lowres_offset (const VtfHeader *header)
+{
+    // 7.3 and later locate the images through the resource directory
+    if (vtf_version_at_least(header, 7, 3))
+        return header->lowResOffset;
+
+    return header->headerSize;
+}
+
+// Where the mip chain starts, or 0 if that can't be told from the header.
+static uint
+vtf_image_offset (const VtfHeader *header)
+{
+    if (vtf_version_at_least(header, 7, 3))
+        return header->highResOffset;
+
+    size_t lowres = frame_size(header->lowResImageFormat,
+        header->lowResImageWidth, header->lowResImageHeight);
+    if (lowres == SIZE_MAX)
+        return 0;
+
+    return header->headerSize + lowres;
+}
+
+#define VTF_HASH_PRIME1 0x9E3779B185EBCA87ull
+#define VTF_HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define VTF_HASH_PRIME3 0x165667B19E3779F9ull
+
+static inline guint64
+vtf_rotl64 (guint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+vtf_hash_round (guint64 acc, guint64 input)
+{
+    return vtf_rotl64(acc + input * VTF_HASH_PRIME2, 31) * VTF_HASH_PRIME1;
+}
+
+// A fast 64 bit hash of a frame, built like XXH64: four independent lanes
+// over 32 byte stripes, merged and mixed at the end. Frames are compared
+// byte for byte whenever the hashes match, so it only has to be good, not
+// the same as XXH64.
+static guint64
+vtf_hash (const guchar *data, gsize size)
+{
+    guint64 lanes[4] = {
+        VTF_HASH_PRIME1 + VTF_HASH_PRIME2, VTF_HASH_PRIME2, 0, -VTF_HASH_PRIME1
+    };
+    gsize i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            guint64 input;
+
+            memcpy(&input, data + i + lane * 8, 8);
+            lanes[lane] = vtf_hash_round(lanes[lane], input);
+        }
+    }
+
+    guint64 hash = vtf_rotl64(lanes[0], 1) + vtf_rotl64(lanes[1], 7) +
+        vtf_rotl64(lanes[2], 12) + vtf_rotl64(lanes[3], 18) + size;
+    for (; i < size; i++)
+        hash = vtf_hash_round(hash, data[i]);
+
+    hash ^= hash >> 33;
+    hash *= VTF_HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= VTF_HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+G_DEFINE_TYPE (VtfAnim, vtf_anim, GDK_TYPE_PIXBUF_ANIMATION);
+G_DEFINE_TYPE (VtfAnimIter, vtf_anim_iter, GDK_TYPE_PIXBUF_ANIMATION_ITER);
+
+// An animation of the given number of frames, with frame 0 decoded into
+// first, that frames are then added to one by one with vtf_anim_add_frame.
+static VtfAnim *
+vtf_anim_new (uint32_t image_format, uint width, uint height, uint frames, GdkPixbuf *first)
+{
+    VtfAnim *anim = g_object_new(vtf_anim_get_type(), NULL);
+
+    anim->image_format = image_format;
+    anim->width = width;
+    anim->height = height;
+    anim->frames = frames;
+    anim->loaded = 0;
+    anim->loading = TRUE;
+    anim->first = g_object_ref(first);
+
+    if (frames > 1) {
+        anim->slices = g_new0(uint, frames);
+        anim->hashes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    return anim;
+}
+
+// Adds the next frame, whose raw data is at src: a copy of it if the
+// animation keeps copies, otherwise just where it is, which has to be
+// stride bytes after the frame before. A frame with the same data as an
+// earlier one is given that one's slice instead.
+static void
+vtf_anim_add_frame (VtfAnim *anim, const guchar *src)
+{
+    uint frame = anim->loaded++;
+
+    if (anim->frames == 1)
+        return;
+
+    // A hash that doesn't fit in a pointer is cut short; that only means
+    // a few more frames are compared.
+    gpointer key = GSIZE_TO_POINTER((gsize)vtf_hash(src, anim->stride));
+    gpointer value;
+
+    if (g_hash_table_lookup_extended(anim->hashes, key, NULL, &value)) {
+        uint slice = GPOINTER_TO_UINT(value);
+
+        if (memcmp(anim->data + (gsize)slice * anim->stride, src, anim->stride) == 0) {
+            anim->slices[frame] = slice;
+            return;
+        }
+    }
+
+    uint slice = anim->raw != NULL ? anim->slice_count : frame;
+
+    if (anim->raw != NULL)
+        memcpy(anim->raw + (gsize)slice * anim->stride, src, anim->stride);
+    anim->slices[frame] = slice;
+    anim->slice_count++;
+    g_hash_table_insert(anim->hashes, key, GUINT_TO_POINTER(slice));
+}
+
+// No more frames are coming. The copies are cut down to the slices that
+// were actually needed.
+static void
+vtf_anim_done (VtfAnim *anim)
+{
+    anim->loading = FALSE;
+
+    if (anim->hashes != NULL) {
+        g_hash_table_destroy(anim->hashes);
+        anim->hashes = NULL;
+    }
+
+    if (anim->raw != NULL && anim->slice_count > 0 && anim->slice_count < anim->frames) {
+        guchar *raw = g_try_realloc(anim->raw, (gsize)anim->slice_count * anim->stride);
+
+        if (raw != NULL) {
+            anim->raw = raw;
+            anim->data = raw;
+        }
+    }
+}
+
+static void
+vtf_slab_unref (G_GNUC_UNUSED guchar *pixels, gpointer data)
+{
+    VtfSlab *slab = data;
+
+    if (g_atomic_int_dec_and_test(&slab->refs)) {
+        g_free(slab->pixels);
+        g_free(slab);
+    }
+}
+
+// A pixbuf for a slot of the ring, a view of its part of the slab. The
+// slab has room for as many slots as there can be distinct frames besides
+// frame 0, and the animation holds a reference of its own to it.
+static GdkPixbuf *
+vtf_anim_new_slot (VtfAnim *anim, uint slot)
+{
+    const VtfFormat *format = vtf_find_format(anim->image_format);
+    int rowstride = (anim->width * format->channels + 3) & ~3;
+    gsize frame_bytes = (gsize)rowstride * anim->height;
+
+    if (anim->slab == NULL) {
+        VtfSlab *slab = g_try_new(VtfSlab, 1);
+        if (slab == NULL)
+            return NULL;
+
+        slab->pixels = g_try_malloc(MIN(anim->frames - 1, VTF_FRAME_RING) * frame_bytes);
+        if (slab->pixels == NULL) {
+            g_free(slab);
+            return NULL;
+        }
+        slab->refs = 1;
+        anim->slab = slab;
+    }
+
+    g_atomic_int_inc(&anim->slab->refs);
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(anim->slab->pixels + slot * frame_bytes,
+        GDK_COLORSPACE_RGB, format->channels == 4, 8, anim->width, anim->height, rowstride,
+        vtf_slab_unref, anim->slab);
+    if (pixbuf == NULL)
+        vtf_slab_unref(NULL, anim->slab);
+
+    return pixbuf;
+}
+
+/*
+ * Frame i as a new reference, decoded unless its slice still is in the
+ * ring. *pin is the slot the caller's previous frame came from, or -1; it
+ * is released, and the slot of this frame is pinned in its place, so that
+ * no other caller decodes over a frame that is still being shown. When
+ * every slot is pinned the frame is decoded outside the ring.
+ */
+static GdkPixbuf *
+vtf_anim_get_frame (VtfAnim *anim, uint i, int *pin)
+{
+    if (*pin >= 0)
+        anim->ring_pins[*pin]--;
+    *pin = -1;
+
+    if (i == 0 || i >= anim->loaded || anim->slices[i] == 0)
+        return g_object_ref(anim->first);
+
+    uint slice = anim->slices[i];
+
+    for (uint slot = 0; slot < VTF_FRAME_RING; slot++) {
+        if (anim->ring[slot] != NULL && anim->ring_slice[slot] == slice) {
+            anim->ring_pins[slot]++;
+            *pin = slot;
+            return g_object_ref(anim->ring[slot]);
+        }
+    }
+
+    const guchar *src = anim->data + (gsize)slice * anim->stride;
+    uint slot = anim->ring_next;
+
+    while (anim->ring_pins[slot] > 0) {
+        slot = (slot + 1) % VTF_FRAME_RING;
+        if (slot == anim->ring_next) {
+            GdkPixbuf *pixbuf = gdk_pixbuf__vtf_load_frame(anim->image_format, anim->bytes, src,
+                anim->width, anim->height, NULL);
+            return pixbuf != NULL ? pixbuf : g_object_ref(anim->first);
+        }
+    }
+
+    GdkPixbuf *pixbuf = anim->ring[slot];
+
+    // Frames that reference the file cost nothing to make anew; the others
+    // are decoded over the oldest one.
+    if (vtf_frame_in_place(anim->image_format, anim->bytes)) {
+        pixbuf = gdk_pixbuf__vtf_load_frame(anim->image_format, anim->bytes, src,
+            anim->width, anim->height, NULL);
+        if (pixbuf != NULL && anim->ring[slot] != NULL)
+            g_object_unref(anim->ring[slot]);
+    } else {
+        if (pixbuf == NULL)
+            pixbuf = vtf_anim_new_slot(anim, slot);
+        if (pixbuf != NULL)
+            vtf_decode_image(vtf_find_format(anim->image_format), vtf_isa, src,
+                gdk_pixbuf_get_pixels(pixbuf), gdk_pixbuf_get_rowstride(pixbuf),
+                anim->width, anim->height,
+                vtf_streaming(gdk_pixbuf_get_rowstride(pixbuf), anim->height));
+    }
+    // out of memory; the static image is better than nothing
+    if (pixbuf == NULL)
+        return g_object_ref(anim->first);
+
+    anim->ring[slot] = pixbuf;
+    anim->ring_slice[slot] = slice;
+    anim->ring_pins[slot]++;
+    anim->ring_next = (slot + 1) % VTF_FRAME_RING;
+    *pin = slot;
+
+    return g_object_ref(pixbuf);
+}
+
+static void
+vtf_anim_init (G_GNUC_UNUSED VtfAnim *anim)
+{
+}
+
+static void
+vtf_anim_finalize (GObject *object)
+{
+    VtfAnim *anim = (VtfAnim *) object;
+
+    g_object_unref(anim->first);
+    for (uint slot = 0; slot < VTF_FRAME_RING; slot++) {
+        if (anim->ring[slot] != NULL)
+            g_object_unref(anim->ring[slot]);
+    }
+    if (anim->slab != NULL)
+        vtf_slab_unref(NULL, anim->slab);
+    if (anim->bytes != NULL)
+        g_bytes_unref(anim->bytes);
+    g_free(anim->raw);
+    g_free(anim->slices);
+    if (anim->hashes != NULL)
+        g_hash_table_destroy(anim->hashes);
+
+    G_OBJECT_CLASS(vtf_anim_parent_class)->finalize(object);
+}
+
+static gboolean
+vtf_anim_is_static_image (GdkPixbufAnimation *animation)
+{
+    return ((VtfAnim *) animation)->frames == 1;
+}
+
+static GdkPixbuf *
+vtf_anim_get_static_image (GdkPixbufAnimation *animation)
+{
+    return ((VtfAnim *) animation)->first;
+}
+
+static void
+vtf_anim_get_size (GdkPixbufAnimation *animation, int *width, int *height)
+{
+    VtfAnim *anim = (VtfAnim *) animation;
+
+    if (width != NULL)
+        *width = anim->width;
+    if (height != NULL)
+        *height = anim->height;
+}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+static GdkPixbufAnimationIter *
+vtf_anim_get_iter (GdkPixbufAnimation *animation, const GTimeVal *start_time)
+{
+    VtfAnimIter *iter = g_object_new(vtf_anim_iter_get_type(), NULL);
+
+    iter->anim = g_object_ref(animation);
+    iter->start_time = *start_time;
+    iter->current_time = *start_time;
+    iter->frame = 0;
+    iter->pixbuf = NULL;
+    iter->slot = -1;
+
+    return GDK_PIXBUF_ANIMATION_ITER(iter);
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+static void
+vtf_anim_class_init (VtfAnimClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    GdkPixbufAnimationClass *anim_class = GDK_PIXBUF_ANIMATION_CLASS(klass);
+
+    object_class->finalize = vtf_anim_finalize;
+
+    anim_class->is_static_image = vtf_anim_is_static_image;
+    anim_class->get_static_image = vtf_anim_get_static_image;
+    anim_class->get_size = vtf_anim_get_size;
+    anim_class->get_iter = vtf_anim_get_iter;
+}
+
+// Milliseconds from the start of the iterator to its current time.
+static gint64
+vtf_anim_iter_elapsed (const VtfAnimIter *iter)
+{
+    return ((gint64)iter->current_time.tv_sec - iter->start_time.tv_sec) * 1000 +
+        ((gint64)iter->current_time.tv_usec - iter->start_time.tv_usec) / 1000;
+}
+
+static void
+vtf_anim_iter_init (G_GNUC_UNUSED VtfAnimIter *iter)
+{
+}
+
+static void
+vtf_anim_iter_finalize (GObject *object)
+{
+    VtfAnimIter *iter = (VtfAnimIter *) object;
+
+    if (iter->slot >= 0)
+        iter->anim->ring_pins[iter->slot]--;
+    if (iter->pixbuf != NULL)
+        g_object_unref(iter->pixbuf);
+    g_object_unref(iter->anim);
+
+    G_OBJECT_CLASS(vtf_anim_iter_parent_class)->finalize(object);
+}
+
+static int
+vtf_anim_iter_get_delay_time (GdkPixbufAnimationIter *animation_iter)
+{
+    VtfAnimIter *iter = (VtfAnimIter *) animation_iter;
+
+    if (iter->anim->frames == 1)
+        return -1;
+
+    return VTF_FRAME_DELAY - vtf_anim_iter_elapsed(iter) % VTF_FRAME_DELAY;
+}
+
+static GdkPixbuf *
+vtf_anim_iter_get_pixbuf (GdkPixbufAnimationIter *animation_iter)
+{
+    VtfAnimIter *iter = (VtfAnimIter *) animation_iter;
+    GdkPixbuf *pixbuf = vtf_anim_get_frame(iter->anim, iter->frame, &iter->slot);
+
+    if (iter->pixbuf != NULL)
+        g_object_unref(iter->pixbuf);
+    iter->pixbuf = pixbuf;
+
+    return pixbuf;
+}
+
+static gboolean
+vtf_anim_iter_on_currently_loading_frame (GdkPixbufAnimationIter *animation_iter)
+{
+    VtfAnimIter *iter = (VtfAnimIter *) animation_iter;
+
+    return iter->anim->loading && iter->frame + 1 >= iter->anim->loaded;
+}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+static gboolean
+vtf_anim_iter_advance (GdkPixbufAnimationIter *animation_iter, const GTimeVal *current_time)
+{
+    VtfAnimIter *iter = (VtfAnimIter *) animation_iter;
+    VtfAnim *anim = iter->anim;
+    uint old_frame = iter->frame;
+
+    iter->current_time = *current_time;
+    // start over if the clock went back
+    if (vtf_anim_iter_elapsed(iter) < 0)
+        iter->start_time = *current_time;
+
+    guint64 position = vtf_anim_iter_elapsed(iter) / VTF_FRAME_DELAY;
+
+    // while loading, wait on the last complete frame
+    if (anim->loading)
+        iter->frame = MIN(position, (guint64)MAX(anim->loaded, 1) - 1);
+    else
+        iter->frame = position % anim->frames;
+
+    return iter->frame != old_frame;
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+static void
+vtf_anim_iter_class_init (VtfAnimIterClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    GdkPixbufAnimationIterClass *iter_class = GDK_PIXBUF_ANIMATION_ITER_CLASS(klass);
+
+    object_class->finalize = vtf_anim_iter_finalize;
+
+    iter_class->get_delay_time = vtf_anim_iter_get_delay_time;
+    iter_class->get_pixbuf = vtf_anim_iter_get_pixbuf;
+    iter_class->on_currently_loading_frame = vtf_anim_iter_on_currently_loading_frame;
+    iter_class->advance = vtf_anim_iter_advance;
+}
+
+// The kept copy of the size bytes at file offset offset, or NULL if they
+// haven't all arrived or weren't kept.
+static const guchar *
+vtf_data (const VtfContext *context, gsize offset, gsize size)
+{
+    if (offset + size > context->file_pos)
+        return NULL;
+
+    for (uint i = 0; i < context->range_count; i++) {
+        const VtfRange *range = &context->ranges[i];
+
+        if (range->start <= offset && offset + size <= range->end)
+            return context->buffer + range->pos + (offset - range->start);
+    }
+    return NULL;
+}
+
+// Creates frame 0 and the animation before the file is complete, and hands
+// them out. The frame starts out cleared, and the animation with room for
+// the raw data of the other frames.
+static gboolean
+vtf_new_first (VtfContext *context, const VtfFormat *format, uint width, uint height,
+               GError **error)
+{
+    VtfHeader *header = &context->header;
+
+    context->first = gdk_pixbuf_new(GDK_COLORSPACE_RGB, format->channels == 4, 8, width, height);
+    if (context->first == NULL)
+        goto allocerror;
+    gdk_pixbuf_fill(context->first, 0);
+
+    context->anim = vtf_anim_new(header->highResImageFormat, width, height, header->frames, context->first);
+    if (header->frames > 1) {
+        context->anim->stride = vtf_mip_size(header, context->mip, 1);
+        context->anim->raw = g_try_malloc((gsize)header->frames * context->anim->stride);
+        if (context->anim->raw == NULL) {
+            g_object_unref(context->anim);
+            g_object_unref(context->first);
+            context->anim = NULL;
+            context->first = NULL;
+            goto allocerror;
+        }
+        context->anim->data = context->anim->raw;
+    }
+
+    context->prepared_func(context->first, GDK_PIXBUF_ANIMATION(context->anim), context->user_data);
+    return TRUE;
+
+allocerror:
+    g_set_error (
+        error,
+        GDK_PIXBUF_ERROR,
+        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+        "Could not allocate pixbuf object");
+    return FALSE;
+}
+
+/*
+ * Mips are stored smallest first, so a streaming load completes the small
+ * ones long before the one being loaded. Once one of the three below it is
+ * complete, frame 0 is handed out with that mip scaled up, and sharpened
+ * each time a larger one completes, much like an interlaced PNG. Fails
+ * only if frame 0 can't be allocated.
+ */
+static gboolean
+vtf_update_preview (VtfContext *context, GError **error)
+{
+    VtfHeader *header = &context->header;
+    const VtfFormat *format = vtf_find_format(header->highResImageFormat);
+    const guchar *src = NULL;
+    int best = -1;
+
+    if (format == NULL || context->image_offset == 0)
+        return TRUE;
+
+    // nothing to preview once the mip being loaded has started
+    if (context->rows_done > 0 || vtf_data(context, context->image_offset + vtf_offset(header, 0, 0, 0, context->mip),
+                 vtf_mip_size(header, context->mip, 1)) != NULL)
+        return TRUE;
+
+    for (int level = context->preview_mip; level > (int)context->mip; level--) {
+        const guchar *data = vtf_data(context, context->image_offset + vtf_offset(header, 0, 0, 0, level),
+            vtf_mip_size(header, level, 1));
+        if (data == NULL)
+            break;
+        src = data;
+        best = level;
+    }
+    if (best < 0)
+        return TRUE;
+    context->preview_mip = best - 1;
+
+    uint width = MAX(header->width >> context->mip, 1);
+    uint height = MAX(header->height >> context->mip, 1);
+    uint mip_width = MAX(header->width >> best, 1);
+    uint mip_height = MAX(header->height >> best, 1);
+
+    // a preview is optional, and frame 0 might still fit without it
+    GdkPixbuf *mip = gdk_pixbuf_new(GDK_COLORSPACE_RGB, format->channels == 4, 8, mip_width, mip_height);
+    if (mip == NULL)
+        return TRUE;
+    vtf_decode_image(format, vtf_isa, src, gdk_pixbuf_get_pixels(mip), gdk_pixbuf_get_rowstride(mip),
+        mip_width, mip_height, vtf_streaming(gdk_pixbuf_get_rowstride(mip), mip_height));
+
+    if (context->first == NULL && !vtf_new_first(context, format, width, height, error)) {
+        g_object_unref(mip);
+        return FALSE;
+    }
+    gdk_pixbuf_scale(mip, context->first, 0, 0, width, height, 0, 0,
+        (double)width / mip_width, (double)height / mip_height, GDK_INTERP_NEAREST);
+    g_object_unref(mip);
+
+    if (context->updated_func != NULL)
+        context->updated_func(context->first, 0, 0, width, height, context->user_data);
+    return TRUE;
+}
+
+/*
+ * Frame 0 of the mip being loaded is decoded as it arrives, four rows at a
+ * time so that DXT block rows and the dither pattern line up, and each new
+ * band is reported. The mip is the last and largest part of what is read,
+ * so this overlaps most of the decoding with the reading. Fails only if
+ * frame 0 can't be allocated.
+ */
+#define VTF_BAND_ROWS 4
+
+static gboolean
+vtf_update_rows (VtfContext *context, GError **error)
+{
+    VtfHeader *header = &context->header;
+    const VtfFormat *format = vtf_find_format(header->highResImageFormat);
+    uint width = MAX(header->width >> context->mip, 1);
+    uint height = MAX(header->height >> context->mip, 1);
+
+    if (format == NULL || context->image_offset == 0 || context->rows_done == height)
+        return TRUE;
+
+    gsize start = (gsize)context->image_offset + vtf_offset(header, 0, 0, 0, context->mip);
+    gsize frame_bytes = vtf_mip_size(header, context->mip, 1);
+    gsize band_bytes = frame_size(header->highResImageFormat, width, VTF_BAND_ROWS);
+
+    if (context->file_pos <= start)
+        return TRUE;
+
+    gsize received = MIN(context->file_pos - start, frame_bytes);
+    uint rows = received == frame_bytes ? height : received / band_bytes * VTF_BAND_ROWS;
+    if (rows <= context->rows_done)
+        return TRUE;
+
+    if (context->first == NULL && !vtf_new_first(context, format, width, height, error))
+        return FALSE;
+
+    const guchar *src = vtf_data(context, start, received);
+    int rowstride = gdk_pixbuf_get_rowstride(context->first);
+    uint y = context->rows_done;
+
+    vtf_decode_image(format, vtf_isa, src + y / VTF_BAND_ROWS * band_bytes,
+        gdk_pixbuf_get_pixels(context->first) + (gsize)y * rowstride, rowstride,
+        width, rows - y, vtf_streaming(rowstride, height));
+    context->rows_done = rows;
+
+    if (context->updated_func != NULL)
+        context->updated_func(context->first, 0, y, width, rows - y, context->user_data);
+    return TRUE;
+}
+
+/*
+ * Each frame of the mip being loaded is handed to the animation as soon as
+ * it is complete, which keeps its raw data and decodes it when it is shown,
+ * and the last range moves on to the next one. Frame 0 is done band by band
+ * by vtf_update_rows.
+ */
+static gboolean
+vtf_update_frames (VtfContext *context, GError **error)
+{
+    VtfHeader *header = &context->header;
+    VtfRange *range = &context->ranges[context->range_count - 1];
+
+    if (context->range_count == 1)
+        return TRUE;
+
+    while (context->frame < header->frames && context->file_pos >= range->end) {
+        if (context->frame == 0 && !vtf_update_rows(context, error))
+            return FALSE;
+        vtf_anim_add_frame(context->anim, context->buffer + range->pos);
+
+        context->frame++;
+        range->start = context->image_offset + vtf_offset(header, context->frame, 0, 0, context->mip);
+        range->end = range->start + vtf_mip_size(header, context->mip, 1);
+    }
+
+    return TRUE;
+}
+
+// Whether the low-res image can stand in for the requested size. It is
+// lossy and often has no alpha, so it is only used for sizes smaller than
+// the hi-res mip that would be decoded for them, never for the full size.
+static gboolean
+vtf_lowres_covers (const VtfHeader *header, gint width, gint height)
+{
+    if (vtf_lowres_offset(header) == 0 || vtf_find_format(header->lowResImageFormat) == NULL)
+        return FALSE;
+
+    uint mip = vtf_pick_mip(header, width, height);
+    if (width >= (gint)MAX(header->width >> mip, 1) || height >= (gint)MAX(header->height >> mip, 1))
+        return FALSE;
+
+    return header->lowResImageWidth > 0 && header->lowResImageHeight > 0 &&
+        header->lowResImageWidth >= width && header->lowResImageHeight >= height;
+}
+
+/*
+ * Thumbnail mode: decodes just the low-res image (normally a 16x16 DXT1)
+ * that follows the header, so icon-sized requests are done after a few
+ * hundred bytes. Everything after it is ignored.
+ */
+static gboolean
+vtf_load_lowres (VtfContext *context, GError **error)
+{
+    VtfHeader *header = &context->header;
+    const VtfFormat *format = vtf_find_format(header->lowResImageFormat);
+    uint width = header->lowResImageWidth, height = header->lowResImageHeight;
+    const guchar *src = vtf_data(context, vtf_lowres_offset(header),
+        frame_size(header->lowResImageFormat, width, height));
+
+    if (src == NULL) {
+        g_set_error (
+            error,
+            GDK_PIXBUF_ERROR,
+            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+            "File corrupt or incomplete");
+        return FALSE;
+    }
+
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, format->channels == 4, 8, width, height);
+    if (pixbuf == NULL) {
+        g_set_error (
+            error,
+            GDK_PIXBUF_ERROR,
+            GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+            "Could not allocate pixbuf object");
+        return FALSE;
+    }
+    vtf_decode_image(format, vtf_isa, src, gdk_pixbuf_get_pixels(pixbuf), gdk_pixbuf_get_rowstride(pixbuf),
+        width, height, vtf_streaming(gdk_pixbuf_get_rowstride(pixbuf), height));
+
+    VtfAnim *anim = vtf_anim_new(header->lowResImageFormat, width, height, 1, pixbuf);
+    vtf_anim_add_frame(anim, src);
+    vtf_anim_done(anim);
+    context->prepared_func(pixbuf, GDK_PIXBUF_ANIMATION(anim), context->user_data);
+    if (context->updated_func != NULL)
+        context->updated_func(pixbuf, 0, 0, width, height, context->user_data);
+    g_object_unref(pixbuf);
+    g_object_unref(anim);
+
+    return TRUE;
+}
+
+static gboolean
+gdk_pixbuf__vtf_image_stop_load (gpointer context_ptr, GError **error)
+{
+    VtfContext *context = (VtfContext *) context_ptr;
+    VtfHeader header = context->header;
+    gboolean retval = TRUE;
+
+    if (context->stopped)
+        goto end;
+
+    if (!context->header_parsed)
+        goto corrupt;
+
+    // With a known layout every frame was handed to the animation as it
+    // arrived.
+    if (context->range_count > 1) {
+        if (context->frame < header.frames)
+            goto corrupt;
+        goto end;
+    }
+
+    // Otherwise the whole file was kept; without an offset from the header
+    // the image is taken to end it.
+    uint fulldata = vtf_offset(&header, header.frames, 0, 0, 0);
+    uint base = context->image_offset;
+
+    if (base == 0) {
+        if (context->file_pos < fulldata)
+            goto corrupt;
+        base = context->file_pos - fulldata;
+    } else if ((guint64)base + fulldata > context->file_pos) {
+        goto corrupt;
+    }
+
+    if (context->bytes == NULL)
+        context->bytes = g_bytes_new_take(context->buffer, context->buffer_data_size);
+
+    // Only decode the mip the consumer needs; the loader scales it the
+    // rest of the way.
+    uint mip = context->mip;
+    uint width = MAX(header.width >> mip, 1);
+    uint height = MAX(header.height >> mip, 1);
+
+    // Only frame 0 is decoded now; the animation reads the others from the
+    // file when they are shown.
+    const guchar *frames = context->buffer + base + vtf_offset(&header, 0, 0, 0, mip);
+
+    context->first = gdk_pixbuf__vtf_load_frame(header.highResImageFormat, context->bytes,
+        frames, width, height, error);
+    if (context->first == NULL) {
+        retval = FALSE;
+        goto end;
+    }
+
+    context->anim = vtf_anim_new(header.highResImageFormat, width, height, header.frames, context->first);
+    if (header.frames > 1) {
+        context->anim->stride = vtf_offset(&header, 1, 0, 0, mip) - vtf_offset(&header, 0, 0, 0, mip);
+        context->anim->data = frames;
+        context->anim->bytes = g_bytes_ref(context->bytes);
+    }
+    for (int i = 0; i < header.frames; i++)
+        vtf_anim_add_frame(context->anim, frames + (gsize)i * context->anim->stride);
+    context->prepared_func(context->first, GDK_PIXBUF_ANIMATION(context->anim), context->user_data);
+
+end:
+    if (context->first != NULL)
+        g_object_unref(context->first);
+    if (context->anim != NULL) {
+        vtf_anim_done(context->anim);
+        g_object_unref(context->anim);
+    }
+    if (context->bytes != NULL)
+        g_bytes_unref(context->bytes);
+    else
+        g_free(context->buffer);
+    g_free(context);
+    
+    return retval;
+
+corrupt:
+    g_set_error (
+        error,
+        GDK_PIXBUF_ERROR,
+        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+        "File corrupt or incomplete");
+    retval = FALSE;
+    goto end;
+}
+
+
+/*
+ * Decides which parts of the file to keep once the header is parsed: the
+ * header, or the low-res image in thumbnail mode, frame 0 of each mip that may be shown as
+ * a preview, and the frame of the mip being loaded that is arriving. The
+ * last range moves on to the next frame as each one is decoded, and larger
+ * mips, which make up most of the file, are never kept when a reduced size
+ * was asked for. Returns how many bytes that is, or 0 if the layout is
+ * unknown or the format can't be decoded, and everything has to be kept.
+ */
+static guint
+vtf_plan_ranges (VtfContext *context)
+{
+    VtfHeader *header = &context->header;
+    guint offset = context->image_offset;
+    guint pos = header->headerSize;
+    uint n = 0;
+
+    if (!context->thumbnail &&
+        (offset == 0 || vtf_find_format(header->highResImageFormat) == NULL))
+        return 0;
+
+    context->ranges[n++] = (VtfRange){ 0, header->headerSize, 0 };
+
+    if (context->thumbnail) {
+        guint start = vtf_lowres_offset(header);
+        guint size = frame_size(header->lowResImageFormat,
+            header->lowResImageWidth, header->lowResImageHeight);
+
+        context->ranges[n++] = (VtfRange){ start, start + size, pos };
+        pos += size;
+    } else {
+        for (int level = context->preview_mip; level > (int)context->mip; level--) {
+            guint start = offset + vtf_offset(header, 0, 0, 0, level);
+            guint size = vtf_mip_size(header, level, 1);
+
+            context->ranges[n++] = (VtfRange){ start, start + size, pos };
+            pos += size;
+        }
+
+        guint start = offset + vtf_offset(header, 0, 0, 0, context->mip);
+        guint size = vtf_mip_size(header, context->mip, 1);
+
+        context->ranges[n++] = (VtfRange){ start, start + size, pos };
+        pos += size;
+    }
+
+    context->range_count = n;
+    return pos;
+}
+
+static gboolean
+vtf_too_large (GError **error)
+{
+    g_set_error (
+        error,
+        GDK_PIXBUF_ERROR,
+        GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+        "VTF image exceeds the loader's size limits");
+    return FALSE;
+}
+
+static gboolean
+vtf_resize_buffer (VtfContext *context, gsize size, GError **error)
+{
+    guchar *buffer = g_try_realloc(context->buffer, size);
+
+    if (buffer == NULL) {
+        g_set_error (
+            error,
+            GDK_PIXBUF_ERROR,
+            GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY,
+            ("Not enough memory"));
+        return FALSE;
+    }
+
+    context->buffer = buffer;
+    context->buffer_size = size;
+    return TRUE;
+}
+
+// Takes the next size bytes of the file, keeping the parts that fall in a
+// kept range.
+static gboolean
+vtf_keep (VtfContext *context, const guchar *data, guint size, GError **error)
+{
+    gsize file_end = context->file_pos + size;
+
+    for (uint i = 0; i < context->range_count; i++) {
+        const VtfRange *range = &context->ranges[i];
+        gsize start = MAX(range->start, context->file_pos);
+        gsize end = MIN(range->end, file_end);
+
+        if (start >= end)
+            continue;
+
+        // Until the header tells how much will be kept, only take what
+        // arrives; with an unknown layout fall back to doubling.
+        gsize pos = range->pos + (start - range->start);
+        gsize needed = pos + (end - start);
+        if (needed > context->buffer_size) {
+            guint64 limit = MIN(vtf_max_bytes, G_MAXUINT);
+            gsize new_size = needed;
+
+            if (needed > limit)
+                return vtf_too_large(error);
+            if (context->header_parsed)
+                new_size = MIN(MAX(needed, (gsize)context->buffer_size * 2), limit);
+            if (!vtf_resize_buffer(context, new_size, error))
+                return FALSE;
+        }
+
+        memcpy(context->buffer + pos, data + (start - context->file_pos), end - start);
+        context->buffer_data_size = MAX(context->buffer_data_size, needed);
+    }
+
+    context->file_pos = file_end;
+    return TRUE;
+}
+
+/*
+ * Checks, with 64-bit math, that the layout the header declares fits the
+ * 32-bit offsets the format and vtf_offset use; past this point their
+ * arithmetic can't overflow.
+ */
+static gboolean
+vtf_check_layout (const VtfHeader *header)
+{
+    const VtfFormat *format = vtf_find_format(header->highResImageFormat);
+    guint64 lowres = frame_size(header->lowResImageFormat,
+        header->lowResImageWidth, header->lowResImageHeight);
+    guint64 total = 0;
+
+    if (header->width == 0 || header->height == 0 || header->mipmapCount == 0)
+        return FALSE;
+
+    if (lowres != SIZE_MAX && (guint64)vtf_lowres_offset(header) + lowres > G_MAXUINT)
+        return FALSE;
+
+    // the rest can't be told for formats the loader doesn't know
+    if (format == NULL)
+        return TRUE;
+
+    for (uint level = 0; level < header->mipmapCount; level++) {
+        uint width = MAX(header->width >> level, 1);
+        uint height = MAX(header->height >> level, 1);
+        uint depth = MAX(header->depth >> level, 1);
+        guint64 rows = (height + format->block - 1) / format->block;
+
+        total += frame_size(header->highResImageFormat, width, format->block) * rows * depth;
+        if (total > G_MAXUINT)
+            return FALSE;
+    }
+
+    total = total * header->frames + vtf_image_offset(header);
+    return total <= G_MAXUINT;
+}
+
+// Checks what the load will take against the configured limits.
+static gboolean
+vtf_check_limits (VtfContext *context, GError **error)
+{
+    VtfHeader *header = &context->header;
+    const VtfFormat *format = vtf_find_format(header->highResImageFormat);
+
+    if (context->thumbnail || format == NULL)
+        return TRUE;
+
+    guint64 pixels = (guint64)MAX(header->width >> context->mip, 1) *
+        MAX(header->height >> context->mip, 1);
+    // frame 0 and the ring of other frames the animation keeps decoded, and
+    // the raw data of the others if it isn't read from the file in place
+    guint64 bytes = context->expected_size +
+        pixels * format->channels * MIN(header->frames, 1 + VTF_FRAME_RING);
+    if (context->expected_size != 0)
+        bytes += (guint64)header->frames * vtf_mip_size(header, context->mip, 1);
+
+    if (pixels > vtf_max_pixels || header->frames > vtf_max_frames || bytes > vtf_max_bytes)
+        return vtf_too_large(error);
+
+    return TRUE;
+}
+
+// Parses the complete header at the start of the buffer and works out
+// what to load. The header is parsed as soon as it is complete, so that
+// size probes can stop after the first few bytes instead of reading the
+// file.
+static gboolean
+vtf_read_header (VtfContext *context, GError **error)
+{
+    if (!vtf_parse_header(&context->header, context->buffer, context->file_pos)) {
+        g_set_error (
+            error,
+            GDK_PIXBUF_ERROR,
+            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+            "File corrupt or incomplete");
+        return FALSE;
+    }
+    context->header_parsed = TRUE;
+    context->requested_width = context->header.width;
+    context->requested_height = context->header.height;
+
+    if (context->size_func != NULL) {
+        gint width = context->header.width, height = context->header.height;
+
+        context->size_func(&width, &height, context->user_data);
+        context->requested_width = width;
+        context->requested_height = height;
+        if (width == 0 || height == 0) {
+            g_set_error (
+                error,
+                GDK_PIXBUF_ERROR,
+                GDK_PIXBUF_ERROR_FAILED,
+                "Transformed VTF has zero width or height.");
+            return FALSE;
+        }
+    }
+
+    context->mip = vtf_pick_mip(&context->header, context->requested_width, context->requested_height);
+    context->image_offset = vtf_image_offset(&context->header);
+    context->preview_mip = MIN((int)context->header.mipmapCount - 1, (int)context->mip + 3);
+    context->thumbnail = vtf_lowres_covers(&context->header,
+        context->requested_width, context->requested_height);
+
+    if (!vtf_check_layout(&context->header)) {
+        g_set_error (
+            error,
+            GDK_PIXBUF_ERROR,
+            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+            "VTF layout doesn't fit in a file");
+        return FALSE;
+    }
+
+    // a mapped file is read in place
+    if (!context->mapped)
+        context->expected_size = vtf_plan_ranges(context);
+    if (!vtf_check_limits(context, error))
+        return FALSE;
+    if (context->expected_size > context->buffer_size &&
+        !vtf_resize_buffer(context, context->expected_size, error))
+        return FALSE;
+
+    return TRUE;
+}
+
+static gboolean
+gdk_pixbuf__vtf_image_load_increment (gpointer      context_ptr,
+                                      const guchar *data,
+                                      guint         size,
+                                      GError      **error)
+{
+    VtfContext* context = (VtfContext*) context_ptr;
+
+    if (context->stopped)
+        return TRUE;
+    
+    // The header is taken on its own, so that everything after it can be
+    // sorted into the ranges it decides on.
+    while (!context->header_parsed && size > 0) {
+        gsize want = vtf_header_length(context->buffer, context->file_pos);
+        guint take = MIN(size, want - context->file_pos);
+
+        if (!vtf_keep(context, data, take, error))
+            goto fail;
+        data += take;
+        size -= take;
+
+        if (context->file_pos >= vtf_header_length(context->buffer, context->file_pos) &&
+            !vtf_read_header(context, error))
+            goto fail;
+    }
+
+    if (context->thumbnail) {
+        const VtfHeader *header = &context->header;
+        size_t end = (size_t)vtf_lowres_offset(header) + frame_size(header->lowResImageFormat,
+            header->lowResImageWidth, header->lowResImageHeight);
+
+        if (!vtf_keep(context, data, size, error))
+            goto fail;
+        if (end <= context->file_pos) {
+            context->stopped = TRUE;
+            return vtf_load_lowres(context, error);
+        }
+        return TRUE;
+    }
+
+    // The frames of the mip being loaded are taken one at a time, since
+    // each one is decoded and dropped as soon as it is complete.
+    while (size > 0) {
+        const VtfRange *range = &context->ranges[context->range_count - 1];
+        guint take = size;
+
+        if (context->range_count > 1 && context->file_pos < range->end)
+            take = MIN(size, range->end - context->file_pos);
+
+        if (!vtf_keep(context, data, take, error))
+            goto fail;
+        data += take;
+        size -= take;
+
+        if (!vtf_update_preview(context, error) || !vtf_update_rows(context, error) ||
+            !vtf_update_frames(context, error))
+            goto fail;
+    }
+
+    return TRUE;
+
+fail:
+    // nothing more is decoded after an error, not even by stop_load
+    context->stopped = TRUE;
+    return FALSE;
+}
+
+static void
+vtf_loaded (G_GNUC_UNUSED GdkPixbuf *pixbuf, GdkPixbufAnimation *anim, gpointer user_data)
+{
+    GdkPixbufAnimation **result = user_data;
+
+    *result = g_object_ref(anim);
+}
+
+// Tells the kernel that the frames of the mip being loaded are about to be
+// read once, front to back.
+static void
+vtf_advise (VtfContext *context)
+{
+#if defined(MADV_SEQUENTIAL) && defined(MADV_WILLNEED)
+    VtfHeader *header = &context->header;
+    gsize page = sysconf(_SC_PAGESIZE);
+
+    if (context->image_offset == 0 || vtf_find_format(header->highResImageFormat) == NULL)
+        return;
+
+    gsize start = context->image_offset + vtf_offset(header, 0, 0, 0, context->mip);
+    gsize end = context->image_offset + vtf_offset(header, header->frames, 0, 0, context->mip);
+    if (end > context->file_pos)
+        return;
+
+    start &= ~(page - 1);
+    madvise(context->buffer + start, end - start, MADV_SEQUENTIAL);
+    madvise(context->buffer + start, end - start, MADV_WILLNEED);
+#else
+    (void)context;
+#endif
+}
+
+/*
+ * Loads a whole file by mapping it instead of reading it through
+ * load_increment, so there is no copy and no buffer to grow: the decoders
+ * read the mapping, and RGBA8888 frames reference it.
+ */
+static GdkPixbufAnimation *
+vtf_load_mapped (FILE *f, GError **error)
+{
+    GdkPixbufAnimation *anim = NULL;
+    gboolean failed = FALSE;
+
+    GMappedFile *file = g_mapped_file_new_from_fd(fileno(f), FALSE, error);
+    if (file == NULL)
+        return NULL;
+
+    if (g_mapped_file_get_length(file) > G_MAXUINT) {
+        g_mapped_file_unref(file);
+        vtf_too_large(error);
+        return NULL;
+    }
+
+    VtfContext *context = gdk_pixbuf__vtf_image_begin_load(NULL, vtf_loaded, NULL, &anim, error);
+    if (context == NULL) {
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+    context->bytes = g_mapped_file_get_bytes(file);
+    context->buffer = (guchar *)g_mapped_file_get_contents(file);
+    context->buffer_size = g_mapped_file_get_length(file);
+    context->buffer_data_size = context->buffer_size;
+    context->file_pos = context->buffer_size;
+    context->mapped = TRUE;
+    g_mapped_file_unref(file);
+
+    // stop_load reports a file too short for its header
+    if (context->file_pos >= vtf_header_length(context->buffer, context->file_pos)) {
+        if (!vtf_read_header(context, error) ||
+            (context->thumbnail && !vtf_load_lowres(context, error))) {
+            failed = TRUE;
+            context->stopped = TRUE;
+        } else if (context->thumbnail) {
+            context->stopped = TRUE;
+        } else {
+            vtf_advise(context);
+        }
+    }
+
+    if (!gdk_pixbuf__vtf_image_stop_load(context, failed ? NULL : error))
+        failed = TRUE;
+
+    if (failed && anim != NULL) {
+        g_object_unref(anim);
+        anim = NULL;
+    }
+    return anim;
+}
+
+static GdkPixbuf *
+gdk_pixbuf__vtf_image_load (FILE *f, GError **error)
+{
+    GdkPixbufAnimation *anim = vtf_load_mapped(f, error);
+    GdkPixbuf *pixbuf;
+
+    if (anim == NULL)
+        return NULL;
+
+    pixbuf = g_object_ref(gdk_pixbuf_animation_get_static_image(anim));
+    g_object_unref(anim);
+    return pixbuf;
+}
+
+static GdkPixbufAnimation *
+gdk_pixbuf__vtf_image_load_animation (FILE *f, GError **error)
+{
+    return vtf_load_mapped(f, error);
+}
+
+#ifndef INCLUDE_vtf
+#define MODULE_ENTRY(function) G_MODULE_EXPORT void function
+#else
+#define MODULE_ENTRY(function) void _gdk_pixbuf__vtf_ ## function
+#endif
+
+MODULE_ENTRY (fill_vtable) (GdkPixbufModule* module)
+{
+    vtf_init_kernels();
+    vtf_init_limits();
+
     module->begin_load = gdk_pixbuf__vtf_image_begin_load;
     module->stop_load = gdk_pixbuf__vtf_image_stop_load;
     module->load_increment = gdk_pixbuf__vtf_image_load_increment;
+    module->load = gdk_pixbuf__vtf_image_load;
+    module->load_animation = gdk_pixbuf__vtf_image_load_animation;
 }
 
 MODULE_ENTRY (fill_info) (GdkPixbufFormat *info)
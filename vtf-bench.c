@@ -0,0 +1,306 @@
+/*
+ * GdkPixbuf library - VTF image loader kernel benchmark
+ *
+ * Builds against io-vtf.c directly so the static kernels can be timed in
+ * isolation. Every kernel is checked against the scalar reference before
+ * it is timed, and the exit status is non-zero if any check failed.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ */
+
+#include "io-vtf.c"
+
+static guchar *
+random_bytes (size_t size)
+{
+    guchar *data = g_malloc(size);
+    uint32_t x = 2463534242u;
+
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x >> 24;
+    }
+    return data;
+}
+
+/*
+ * The timed sizes are square multiples of 64, so they never reach the
+ * single-block and partial-block tails or the remainder loops. These odd and
+ * non-square sizes, with a tight and with a padded stride, are checked
+ * against scalar with and without streaming stores, and nothing may be
+ * written into the padding. Returns the number of mismatches.
+ */
+static int
+check_edges (const char *name, uint32_t image_format)
+{
+    static const uint sizes[][2] = { { 1, 1 }, { 3, 5 }, { 13, 7 }, { 33, 17 }, { 100, 37 } };
+    const VtfFormat *format = vtf_find_format(image_format);
+    int mismatches = 0;
+
+    for (size_t i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        uint width = sizes[i][0], height = sizes[i][1];
+        guchar *src = random_bytes(frame_size(image_format, width, height));
+
+        for (uint pad = 0; pad <= 13; pad += 13) {
+            size_t row = (size_t)width * format->channels;
+            size_t stride = row + pad;
+            guchar *ref = g_malloc(stride * height);
+            guchar *out = g_malloc(stride * height);
+
+            memset(ref, 0xa5, stride * height);
+            vtf_decode_image(format, VTF_ISA_SCALAR, src, ref, stride, width, height, FALSE);
+            for (uint y = 0; y < height; y++) {
+                for (size_t x = row; x < stride; x++) {
+                    if (ref[y * stride + x] != 0xa5) {
+                        printf("%-8s %4ux%-4u %-7s stride %-4zu padding written\n",
+                            name, width, height, vtf_isa_names[VTF_ISA_SCALAR], stride);
+                        mismatches++;
+                        y = height;
+                        break;
+                    }
+                }
+            }
+
+            for (uint isa = VTF_ISA_SCALAR; isa <= vtf_detect_isa(); isa++) {
+                for (int streaming = 0; streaming < 2; streaming++) {
+                    memset(out, 0xa5, stride * height);
+                    vtf_decode_image(format, isa, src, out, stride, width, height, streaming);
+                    if (memcmp(ref, out, stride * height) != 0) {
+                        printf("%-8s %4ux%-4u %-7s stride %-4zu%s MISMATCH\n", name, width, height,
+                            vtf_isa_names[isa], stride, streaming ? " streaming" : "");
+                        mismatches++;
+                    }
+                }
+            }
+
+            g_free(out);
+            g_free(ref);
+        }
+        g_free(src);
+    }
+
+    if (mismatches == 0)
+        printf("%-8s odd sizes and padded strides match\n", name);
+    return mismatches;
+}
+
+// Times every level that matches scalar. Returns the number of mismatches.
+static int
+bench_format (const char *name, uint32_t image_format, uint size)
+{
+    const VtfFormat *format = vtf_find_format(image_format);
+    size_t stride = (size_t)size * format->channels;
+    size_t bytes = frame_size(image_format, size, size);
+    guchar *src = random_bytes(bytes);
+    guchar *ref = g_malloc(stride * size);
+    guchar *out = g_malloc(stride * size);
+    int reps = size >= 4096 ? 4 : 16;
+    int mismatches = 0;
+
+    gboolean streaming = vtf_streaming(stride, size);
+
+    vtf_decode_image(format, VTF_ISA_SCALAR, src, ref, stride, size, size, streaming);
+
+    for (uint isa = VTF_ISA_SCALAR; isa <= vtf_detect_isa(); isa++) {
+        memset(out, 0, stride * size);
+        vtf_decode_image(format, isa, src, out, stride, size, size, streaming);
+        if (memcmp(ref, out, stride * size) != 0) {
+            printf("%-8s %4ux%-4u %-7s MISMATCH\n", name, size, size, vtf_isa_names[isa]);
+            mismatches++;
+            continue;
+        }
+
+        gint64 start = g_get_monotonic_time();
+        for (int r = 0; r < reps; r++)
+            vtf_decode_image(format, isa, src, out, stride, size, size, streaming);
+        gint64 elapsed = g_get_monotonic_time() - start;
+
+        printf("%-8s %4ux%-4u %-7s %8.1f Mpix/s\n", name, size, size, vtf_isa_names[isa],
+            (double)size * size * reps / (double)MAX(elapsed, 1));
+    }
+
+    g_free(out);
+    g_free(ref);
+    g_free(src);
+    return mismatches;
+}
+
+// Decodes in bands of VTF_BAND_ROWS rows, as the incremental loader does.
+static void
+decode_bands (const VtfFormat *format, uint32_t image_format, VtfIsa isa, const guchar *src,
+              guchar *out, size_t stride, uint size, gboolean streaming)
+{
+    size_t band_bytes = frame_size(image_format, size, VTF_BAND_ROWS);
+
+    for (uint y = 0; y < size; y += VTF_BAND_ROWS)
+        vtf_decode_image(format, isa, src + y / VTF_BAND_ROWS * band_bytes, out + y * stride,
+            stride, size, MIN(VTF_BAND_ROWS, size - y), streaming);
+}
+
+// Output bandwidth of the best kernel with normal and with streaming stores,
+// decoding band by band like the incremental loader. Returns whether the
+// two disagree.
+static gboolean
+bench_stream (const char *name, uint32_t image_format, uint size)
+{
+    const VtfFormat *format = vtf_find_format(image_format);
+    VtfIsa isa = vtf_detect_isa();
+    size_t stride = (size_t)size * format->channels;
+    guchar *src = random_bytes(frame_size(image_format, size, size));
+    guchar *ref = g_malloc(stride * size);
+    guchar *out = g_malloc(stride * size);
+    int reps = size >= 8192 ? 2 : size >= 4096 ? 4 : 16;
+    double rate[2];
+    gboolean mismatch;
+
+    for (int streaming = 0; streaming < 2; streaming++) {
+        decode_bands(format, image_format, isa, src, streaming ? out : ref, stride, size, streaming);
+
+        gint64 start = g_get_monotonic_time();
+        for (int r = 0; r < reps; r++)
+            decode_bands(format, image_format, isa, src, out, stride, size, streaming);
+        gint64 elapsed = g_get_monotonic_time() - start;
+
+        rate[streaming] = (double)stride * size * reps / 1000.0 / (double)MAX(elapsed, 1);
+    }
+
+    mismatch = memcmp(ref, out, stride * size) != 0;
+    if (mismatch)
+        printf("%-8s %4ux%-4u %-7s stream MISMATCH\n", name, size, size, vtf_isa_names[isa]);
+    else
+        printf("%-8s %4ux%-4u %-7s %6.2f GB/s normal %6.2f GB/s streaming\n",
+            name, size, size, vtf_isa_names[isa], rate[0], rate[1]);
+
+    g_free(out);
+    g_free(ref);
+    g_free(src);
+    return mismatch;
+}
+
+static void
+lowres_prepared (GdkPixbuf *pixbuf, G_GNUC_UNUSED GdkPixbufAnimation *anim, gpointer user_data)
+{
+    GdkPixbuf **result = user_data;
+
+    *result = g_object_ref(pixbuf);
+}
+
+static gboolean
+lowres_report (const char *how, GdkPixbuf *pixbuf, const guchar *expected, uint size)
+{
+    gboolean ok = pixbuf != NULL && gdk_pixbuf_get_rowstride(pixbuf) == (int)size * 4 &&
+        memcmp(gdk_pixbuf_get_pixels(pixbuf), expected, (size_t)size * size * 4) == 0;
+
+    printf("lowres   %4ux%-4u %-8s %s\n", size, size, how, ok ? "hi-res" : "MISMATCH");
+    if (pixbuf != NULL)
+        g_object_unref(pixbuf);
+    return !ok;
+}
+
+// A texture no larger than its low-res image has to come out of its own
+// hi-res data, not the lossy DXT1 copy, both streamed and mapped. Returns
+// the number of mismatches.
+static int
+check_lowres (void)
+{
+    enum { size = 16, header_size = 80 };
+    size_t lowres = frame_size(IMAGE_FORMAT_DXT1, size, size);
+    size_t file_size = header_size + lowres + frame_size(IMAGE_FORMAT_RGBA8888, size, size);
+    guchar *file = random_bytes(file_size);
+    const guchar *image = file + header_size + lowres;
+    GdkPixbuf *pixbuf = NULL;
+    int mismatches = 0;
+
+    memset(file, 0, header_size);
+    memcpy(file, "VTF", 4);
+    file[4] = 7;
+    file[8] = 2;
+    file[12] = header_size;
+    file[16] = size;
+    file[18] = size;
+    file[24] = 1;
+    file[52] = IMAGE_FORMAT_RGBA8888;
+    file[56] = 1;
+    file[57] = IMAGE_FORMAT_DXT1;
+    file[61] = size;
+    file[62] = size;
+    file[63] = 1;
+
+    gpointer context = gdk_pixbuf__vtf_image_begin_load(NULL, lowres_prepared, NULL, &pixbuf, NULL);
+    gdk_pixbuf__vtf_image_load_increment(context, file, file_size, NULL);
+    gdk_pixbuf__vtf_image_stop_load(context, NULL);
+    mismatches += lowres_report("streamed", pixbuf, image, size);
+
+    FILE *f = tmpfile();
+    if (f != NULL) {
+        fwrite(file, 1, file_size, f);
+        fflush(f);
+        mismatches += lowres_report("mapped", gdk_pixbuf__vtf_image_load(f, NULL), image, size);
+        fclose(f);
+    } else {
+        printf("lowres   %4ux%-4u %-8s no temporary file\n", size, size, "mapped");
+        mismatches++;
+    }
+
+    g_free(file);
+    return mismatches;
+}
+
+int
+main (void)
+{
+    static const struct { const char *name; uint32_t format; gboolean dither; } formats[] = {
+        { "DXT1",     IMAGE_FORMAT_DXT1,          FALSE },
+        { "DXT3",     IMAGE_FORMAT_DXT3,          FALSE },
+        { "DXT5",     IMAGE_FORMAT_DXT5,          FALSE },
+        { "BGRA8888", IMAGE_FORMAT_BGRA8888,      FALSE },
+        { "BGR888",   IMAGE_FORMAT_BGR888,        FALSE },
+        { "RGBA16F",  IMAGE_FORMAT_RGBA16161616F, FALSE },
+        { "RGBA16",   IMAGE_FORMAT_RGBA16161616,  FALSE },
+        { "RGBA16D",  IMAGE_FORMAT_RGBA16161616,  TRUE },
+        { "RGB565",   IMAGE_FORMAT_RGB565,        FALSE },
+        { "IA88",     IMAGE_FORMAT_IA88,          FALSE },
+    };
+    static const uint sizes[] = { 256, 2048, 4096 };
+    static const uint stream_sizes[] = { 1024, 4096, 8192 };
+    int failures = 0;
+
+    vtf_init_kernels();
+    failures += check_lowres();
+
+    // every kernel, not only those of the formats timed below
+    for (uint32_t f = 0; f < G_N_ELEMENTS(vtf_formats); f++) {
+        const VtfFormat *format = vtf_find_format(f);
+        char name[16];
+
+        for (int dither = 0; format != NULL && dither <= (format->dither_rows[0] != NULL); dither++) {
+            g_snprintf(name, sizeof(name), "format%u%s", f, dither ? "D" : "");
+            vtf_dither = dither;
+            failures += check_edges(name, f);
+        }
+    }
+    vtf_dither = FALSE;
+
+    for (size_t f = 0; f < G_N_ELEMENTS(formats); f++) {
+        vtf_dither = formats[f].dither;
+        for (size_t i = 0; i < G_N_ELEMENTS(sizes); i++)
+            failures += bench_format(formats[f].name, formats[f].format, sizes[i]);
+    }
+    vtf_dither = FALSE;
+
+    for (size_t i = 0; i < G_N_ELEMENTS(stream_sizes); i++) {
+        failures += bench_stream("DXT1", IMAGE_FORMAT_DXT1, stream_sizes[i]);
+        failures += bench_stream("BGRA8888", IMAGE_FORMAT_BGRA8888, stream_sizes[i]);
+    }
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}